@@ -0,0 +1,158 @@
+/****************************************************************************
+ *               Fast queries on the grid elements of a grid                *
+ ****************************************************************************/
+#include "ArrayGrid_utils.h"
+
+#include <limits.h>  /* for INT_MAX */
+
+
+/* 'spacings_list' must be a list of integer vectors, one per dimension of
+   the grid. The along-th vector contains the extents of the grid elements
+   along the along-th dimension i.e. it's what get_spacings_along() returns
+   at the R level. */
+static int get_grid_length(SEXP spacings_list, const char *what)
+{
+	int ndim, along;
+	double grid_len;
+
+	ndim = LENGTH(spacings_list);
+	grid_len = 1.0;
+	for (along = 0; along < ndim; along++) {
+		SEXP spacings = VECTOR_ELT(spacings_list, along);
+		if (!IS_INTEGER(spacings))
+			error("S4Arrays internal error in %s():\n"
+			      "    'spacings_list' must be a list of "
+			      "integer vectors", what);
+		grid_len *= LENGTH(spacings);
+	}
+	if (grid_len > INT_MAX)
+		error("%s() does not support grids with more than "
+		      ".Machine$integer.max grid elements", what);
+	return (int) grid_len;
+}
+
+
+/****************************************************************************
+ * dims() and lengths()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_ArrayGrid_dims(SEXP spacings_list)
+{
+	int ndim, grid_len, along, nblock, stride, i, j, k, *col;
+	const int *spacings;
+	SEXP ans;
+
+	ndim = LENGTH(spacings_list);
+	grid_len = get_grid_length(spacings_list, "dims");
+	ans = PROTECT(allocMatrix(INTSXP, grid_len, ndim));
+	stride = 1;
+	for (along = 0; along < ndim; along++) {
+		SEXP s = VECTOR_ELT(spacings_list, along);
+		nblock = LENGTH(s);
+		spacings = INTEGER(s);
+		col = INTEGER(ans) + (R_xlen_t) grid_len * along;
+		/* Column-major order: each extent is repeated 'stride'
+		   times, and the whole pattern is recycled. */
+		i = 0;
+		while (i < grid_len) {
+			for (j = 0; j < nblock; j++)
+				for (k = 0; k < stride; k++)
+					col[i++] = spacings[j];
+		}
+		stride *= nblock;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_ArrayGrid_lengths(SEXP spacings_list)
+{
+	int ndim, grid_len, along, nblock, cur_len, i, j, *out;
+	const int *spacings;
+	double len;
+	SEXP ans;
+
+	ndim = LENGTH(spacings_list);
+	grid_len = get_grid_length(spacings_list, "lengths");
+	ans = PROTECT(NEW_INTEGER(grid_len));
+	if (grid_len == 0) {
+		UNPROTECT(1);
+		return ans;
+	}
+	out = INTEGER(ans);
+	/* The lengths of the grid elements of the subgrid formed by the
+	   first dimensions are in 'out[0:cur_len)'. They are expanded in
+	   place along each new dimension. 'j' goes down so 'out[0:cur_len)'
+	   is only overwritten at the last iteration. */
+	out[0] = 1;
+	cur_len = 1;
+	for (along = 0; along < ndim; along++) {
+		SEXP s = VECTOR_ELT(spacings_list, along);
+		nblock = LENGTH(s);
+		spacings = INTEGER(s);
+		for (j = nblock - 1; j >= 0; j--) {
+			int *out_j = out + (R_xlen_t) j * cur_len;
+			for (i = 0; i < cur_len; i++) {
+				len = (double) out[i] * spacings[j];
+				if (len > INT_MAX)
+					error("some grid elements are "
+					      "longer than "
+					      ".Machine$integer.max");
+				out_j[i] = (int) len;
+			}
+		}
+		cur_len *= nblock;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * downsample()
+ */
+
+/* Keep every ratio-th tickmark along each dimension, plus the last one.
+   Same as 'tm[seq2(length(tm), r)]' at the R level. */
+/* --- .Call ENTRY POINT --- */
+SEXP C_downsample_tickmarks(SEXP tickmarks, SEXP ratio)
+{
+	int ndim, along, tm_len, r, ans_len, i;
+	const int *tm;
+	SEXP ans, ans_tm;
+
+	ndim = LENGTH(tickmarks);
+	if (!IS_INTEGER(ratio) || LENGTH(ratio) != ndim)
+		error("S4Arrays internal error in C_downsample_tickmarks():\n"
+		      "    'ratio' must be an integer vector parallel "
+		      "to 'tickmarks'");
+	ans = PROTECT(NEW_LIST(ndim));
+	for (along = 0; along < ndim; along++) {
+		SEXP x_tm = VECTOR_ELT(tickmarks, along);
+		tm_len = LENGTH(x_tm);
+		tm = INTEGER(x_tm);
+		r = INTEGER(ratio)[along];
+		if (tm_len == 0) {
+			ans_len = 0;
+		} else {
+			if (r <= 0)
+				error("S4Arrays internal error in "
+				      "C_downsample_tickmarks():\n"
+				      "    'ratio' must contain positive "
+				      "values");
+			ans_len = tm_len / r + (tm_len % r != 0);
+		}
+		ans_tm = PROTECT(NEW_INTEGER(ans_len));
+		for (i = 0; i < ans_len; i++) {
+			int pos = i < ans_len - 1 ? (i + 1) * r : tm_len;
+			INTEGER(ans_tm)[i] = tm[pos - 1];
+		}
+		SET_VECTOR_ELT(ans, along, ans_tm);
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
@@ -0,0 +1,13 @@
+#ifndef _ARRAYGRID_UTILS_H_
+#define _ARRAYGRID_UTILS_H_
+
+#include <Rdefines.h>
+
+SEXP C_get_ArrayGrid_dims(SEXP spacings_list);
+
+SEXP C_get_ArrayGrid_lengths(SEXP spacings_list);
+
+SEXP C_downsample_tickmarks(SEXP tickmarks, SEXP ratio);
+
+#endif  /* _ARRAYGRID_UTILS_H_ */
+
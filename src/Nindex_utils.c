@@ -0,0 +1,419 @@
+/****************************************************************************
+ *                     Native N-index subsetting utilities                  *
+ ****************************************************************************/
+#include "Nindex_utils.h"
+
+#include "atomic_utils.h"
+
+#include <limits.h>  /* for INT_MAX */
+#include <string.h>  /* for memcpy() */
+
+
+/****************************************************************************
+ * Normalization of the subscripts of an N-index
+ *
+ * Each subscript in the N-index is either:
+ *   - NULL: The subscript runs along the full extent of the dimension.
+ *   - A RangeNSBS object: The subscript is the range of positions
+ *     start:end stored in the object's "subscript" slot. This is how
+ *     makeNindexFromArrayViewport() represents the ranges of a viewport.
+ *   - An integer (or numeric) vector of valid positions.
+ * Subscripts of the first 2 kinds, as well as integer vectors that form
+ * a sequence of consecutive positions, are turned into a range (0-based
+ * start + length) so no positions need to be materialized.
+ */
+
+typedef struct subscript_t {
+	R_xlen_t len;
+	R_xlen_t start;        /* 0-based, or -1 if not a range */
+	const int *pos_int;    /* 1-based positions if not a range */
+	const double *pos_dbl; /* idem (only one of the 2 is not NULL) */
+} Subscript;
+
+static inline R_xlen_t get_subscript_pos(const Subscript *s, R_xlen_t k)
+{
+	if (s->start >= 0)
+		return s->start + k;
+	if (s->pos_int != NULL)
+		return (R_xlen_t) s->pos_int[k] - 1;
+	return (R_xlen_t) s->pos_dbl[k] - 1;
+}
+
+static int is_RangeNSBS(SEXP x)
+{
+	return IS_S4_OBJECT(x) && inherits(x, "RangeNSBS");
+}
+
+static void load_subscript(SEXP subscript, int along, int d, Subscript *s)
+{
+	R_xlen_t n, k;
+	SEXP range;
+
+	s->pos_int = NULL;
+	s->pos_dbl = NULL;
+	if (subscript == R_NilValue) {
+		s->start = 0;
+		s->len = d;
+		return;
+	}
+	if (is_RangeNSBS(subscript)) {
+		range = R_do_slot(subscript, install("subscript"));
+		if (!IS_INTEGER(range) || LENGTH(range) != 2)
+			error("S4Arrays internal error in load_subscript():\n"
+			      "    invalid RangeNSBS object");
+		int range_start = INTEGER(range)[0];
+		int range_end = INTEGER(range)[1];
+		if (range_start < 1 || range_end > d ||
+		    range_end < range_start - 1)
+			error("'Nindex[[%d]]' contains out-of-bound positions",
+			      along + 1);
+		s->start = range_start - 1;
+		s->len = range_end - range_start + 1;
+		return;
+	}
+	if (IS_INTEGER(subscript)) {
+		s->pos_int = INTEGER(subscript);
+	} else if (IS_NUMERIC(subscript)) {
+		s->pos_dbl = REAL(subscript);
+	} else {
+		error("'Nindex[[%d]]' must be NULL, an integer vector, "
+		      "or a RangeNSBS object", along + 1);
+	}
+	n = XLENGTH(subscript);
+	s->start = -1;
+	s->len = n;
+	for (k = 0; k < n; k++) {
+		double pos = s->pos_int != NULL ? (double) s->pos_int[k]
+						: s->pos_dbl[k];
+		/* Comparisons with NA or NaN are false. */
+		if (!(pos >= 1.0 && pos < (double) d + 1.0) ||
+		    (s->pos_int != NULL && s->pos_int[k] == NA_INTEGER))
+			error("'Nindex[[%d]]' contains NAs or "
+			      "out-of-bound positions", along + 1);
+	}
+	/* Check whether the positions are consecutive. */
+	for (k = 1; k < n; k++)
+		if (get_subscript_pos(s, k) != get_subscript_pos(s, 0) + k)
+			return;
+	if (n != 0)
+		s->start = get_subscript_pos(s, 0);
+	return;
+}
+
+
+/****************************************************************************
+ * Walking on the array elements selected by an N-index
+ *
+ * The selection is walked in the order of the elements of the result of
+ * subset_by_Nindex(), by blocks of 'inner_len' elements:
+ *   - If the first subscript is a range, then the first dimensions up to
+ *     the first one that is not fully selected (included) form a single
+ *     contiguous run of elements in the array. For example, a viewport
+ *     that selects full columns of a matrix is a single run.
+ *   - Otherwise, each block is the selection along the first dimension,
+ *     and it gets gathered (or scattered) one element at a time.
+ * The remaining "outer" dimensions are walked with an odometer.
+ */
+
+typedef struct nindex_plan_t {
+	int ndim, inner;        /* 'inner' is the 1st outer dimension */
+	int inner_is_run;       /* 0 if the 1st subscript is not a range */
+	R_xlen_t inner_offset;  /* offset of the run in the array */
+	R_xlen_t inner_len;     /* nb of selected elements per block */
+	R_xlen_t nelt;          /* total nb of selected elements */
+	const Subscript *subs;
+	const R_xlen_t *strides;
+} NindexPlan;
+
+static NindexPlan make_Nindex_plan(const int *dim, int ndim,
+				   const Subscript *subs, R_xlen_t *strides)
+{
+	NindexPlan plan;
+	int along;
+
+	plan.ndim = ndim;
+	plan.subs = subs;
+	plan.strides = strides;
+	plan.nelt = 1;
+	for (along = 0; along < ndim; along++) {
+		strides[along] = along == 0 ? 1 : strides[along - 1] *
+						  dim[along - 1];
+		plan.nelt *= subs[along].len;
+	}
+	plan.inner_offset = 0;
+	plan.inner_len = 1;
+	along = 0;
+	if (ndim != 0 && subs[0].start < 0) {
+		plan.inner_is_run = 0;
+		plan.inner_len = subs[0].len;
+		along = 1;
+	} else {
+		plan.inner_is_run = 1;
+		/* Merge the fully selected leading dimensions with the
+		   following one. */
+		while (along < ndim && subs[along].start >= 0) {
+			const Subscript *s = subs + along;
+			plan.inner_offset += s->start * strides[along];
+			plan.inner_len *= s->len;
+			along++;
+			if (s->start != 0 || s->len != dim[along - 1])
+				break;
+		}
+	}
+	plan.inner = along;
+	return plan;
+}
+
+#define DEFINE_GATHER_SCATTER_FUNS(suffix, type)			\
+static void gather_##suffix(type *out, const type *in,			\
+			    const Subscript *s)				\
+{									\
+	R_xlen_t k;							\
+	if (s->pos_int != NULL) {					\
+		const int *pos = s->pos_int;				\
+		for (k = 0; k < s->len; k++)				\
+			out[k] = in[pos[k] - 1];			\
+	} else {							\
+		const double *pos = s->pos_dbl;				\
+		for (k = 0; k < s->len; k++)				\
+			out[k] = in[(R_xlen_t) pos[k] - 1];		\
+	}								\
+}									\
+static void scatter_##suffix(type *out, const type *in,		\
+			     const Subscript *s)			\
+{									\
+	R_xlen_t k;							\
+	if (s->pos_int != NULL) {					\
+		const int *pos = s->pos_int;				\
+		for (k = 0; k < s->len; k++)				\
+			out[pos[k] - 1] = in[k];			\
+	} else {							\
+		const double *pos = s->pos_dbl;				\
+		for (k = 0; k < s->len; k++)				\
+			out[(R_xlen_t) pos[k] - 1] = in[k];		\
+	}								\
+}
+
+DEFINE_GATHER_SCATTER_FUNS(Rbyte, Rbyte)
+DEFINE_GATHER_SCATTER_FUNS(int, int)
+DEFINE_GATHER_SCATTER_FUNS(double, double)
+DEFINE_GATHER_SCATTER_FUNS(Rcomplex, Rcomplex)
+
+/* Copy the elements of 'block' to the positions in 'array' selected by
+   subscript 's' if 'to_array' is 1, or the other way around if 0. */
+static void gather_or_scatter_elts(char *array, char *block, size_t eltsize,
+				   const Subscript *s, int to_array)
+{
+	switch (eltsize) {
+	    case sizeof(Rbyte):
+		if (to_array)
+			scatter_Rbyte((Rbyte *) array, (Rbyte *) block, s);
+		else
+			gather_Rbyte((Rbyte *) block, (Rbyte *) array, s);
+		return;
+	    case sizeof(int):
+		if (to_array)
+			scatter_int((int *) array, (int *) block, s);
+		else
+			gather_int((int *) block, (int *) array, s);
+		return;
+	    case sizeof(double):
+		if (to_array)
+			scatter_double((double *) array, (double *) block, s);
+		else
+			gather_double((double *) block, (double *) array, s);
+		return;
+	    case sizeof(Rcomplex):
+		if (to_array)
+			scatter_Rcomplex((Rcomplex *) array,
+					 (Rcomplex *) block, s);
+		else
+			gather_Rcomplex((Rcomplex *) block,
+					(Rcomplex *) array, s);
+		return;
+	}
+	error("S4Arrays internal error in gather_or_scatter_elts():\n"
+	      "    unsupported element size");
+}
+
+/* Copy the selected elements of 'array' to 'block' if 'to_array' is 0,
+   or the elements of 'block' to the selected elements of 'array' if 1.
+   When writing to the array, 'block' is allowed to be of a different type
+   than 'array' but only if the type conversion can be done with
+   coerce_block() and if 'plan->inner_is_run' is 1. 'idx' must be a buffer
+   of length 'plan->ndim'. */
+static void copy_selection(const NindexPlan *plan,
+		char *array, SEXPTYPE array_type,
+		char *block, SEXPTYPE block_type,
+		int to_array, R_xlen_t *idx)
+{
+	int along;
+	R_xlen_t array_off, block_off, pos;
+	const Subscript *subs = plan->subs;
+	size_t array_eltsize = get_atomic_eltsize(array_type);
+	size_t block_eltsize = get_atomic_eltsize(block_type);
+
+	if (plan->nelt == 0)
+		return;
+	array_off = plan->inner_offset;
+	for (along = plan->inner; along < plan->ndim; along++) {
+		idx[along] = 0;
+		array_off += get_subscript_pos(subs + along, 0) *
+			     plan->strides[along];
+	}
+	block_off = 0;
+	while (1) {
+		char *array_p = array + array_eltsize * array_off;
+		char *block_p = block + block_eltsize * block_off;
+		if (block_type != array_type) {
+			coerce_block(array_p, array_type,
+				     block_p, block_type, plan->inner_len);
+		} else if (!plan->inner_is_run) {
+			gather_or_scatter_elts(array_p, block_p,
+					       array_eltsize, subs, to_array);
+		} else if (to_array) {
+			memcpy(array_p, block_p,
+			       array_eltsize * plan->inner_len);
+		} else {
+			memcpy(block_p, array_p,
+			       array_eltsize * plan->inner_len);
+		}
+		block_off += plan->inner_len;
+		/* Move to the next block. */
+		for (along = plan->inner; along < plan->ndim; along++) {
+			const Subscript *s = subs + along;
+			pos = get_subscript_pos(s, idx[along]);
+			array_off -= pos * plan->strides[along];
+			if (++idx[along] < s->len) {
+				pos = get_subscript_pos(s, idx[along]);
+				array_off += pos * plan->strides[along];
+				break;
+			}
+			idx[along] = 0;
+			pos = get_subscript_pos(s, 0);
+			array_off += pos * plan->strides[along];
+		}
+		if (along == plan->ndim)
+			break;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * C_subset_by_Nindex() and C_write_block_to_array()
+ */
+
+/* Load the subscripts and return the dimensions of the selection. */
+static SEXP load_Nindex(SEXP Nindex, const int *dim, int ndim,
+			Subscript *subs)
+{
+	int along;
+	SEXP ans_dim;
+
+	if (!isVectorList(Nindex) || LENGTH(Nindex) != ndim)
+		error("'Nindex' must be a list with one list element "
+		      "per dimension in the array");
+	ans_dim = PROTECT(NEW_INTEGER(ndim));
+	for (along = 0; along < ndim; along++) {
+		load_subscript(VECTOR_ELT(Nindex, along), along, dim[along],
+			       subs + along);
+		if (subs[along].len > INT_MAX)
+			error("'Nindex[[%d]]' is too long", along + 1);
+		INTEGER(ans_dim)[along] = (int) subs[along].len;
+	}
+	UNPROTECT(1);
+	return ans_dim;
+}
+
+/* Same as 'subset_by_Nindex(x, Nindex)' but without the dimnames.
+   'x' must be an ordinary array of type logical, integer, double, complex,
+   or raw. */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_subset_by_Nindex(SEXP x, SEXP Nindex)
+{
+	int ndim;
+	SEXP x_dim, ans_dim, ans;
+
+	if (get_atomic_eltsize(TYPEOF(x)) == 0)
+		error("S4Arrays internal error in C_subset_by_Nindex():\n"
+		      "    type \"%s\" is not supported",
+		      type2char(TYPEOF(x)));
+	x_dim = GET_DIM(x);
+	if (x_dim == R_NilValue)
+		error("'x' must be an array");
+	ndim = LENGTH(x_dim);
+	Subscript *subs = (Subscript *) R_alloc(ndim, sizeof(Subscript));
+	ans_dim = PROTECT(load_Nindex(Nindex, INTEGER(x_dim), ndim, subs));
+	R_xlen_t *strides = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	R_xlen_t *idx = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	NindexPlan plan = make_Nindex_plan(INTEGER(x_dim), ndim, subs,
+					   strides);
+
+	ans = PROTECT(allocVector(TYPEOF(x), plan.nelt));
+	copy_selection(&plan, (char *) get_atomic_dataptr(x), TYPEOF(x),
+		       (char *) get_atomic_dataptr(ans), TYPEOF(ans), 0, idx);
+	SET_DIM(ans, ans_dim);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* Same as 'replace_by_Nindex(sink, Nindex, block)' where 'sink' is an
+   ordinary array of type logical, integer, double, complex, or raw, and
+   'block' an atomic vector with one element per array element selected
+   by 'Nindex'. The type of 'block' is converted to the type of 'sink' on
+   the fly when possible (see can_coerce_while_copying()), otherwise
+   'block' gets coerced first.
+   If 'in_place' is FALSE, 'sink' gets duplicated first (like '[<-' does
+   on a shared object) and the duplicate is modified and returned.
+   WARNING: If 'in_place' is TRUE, 'sink' is modified IN PLACE so the
+   caller must own the only reference to it. */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_write_block_to_array(SEXP sink, SEXP Nindex, SEXP block,
+			    SEXP in_place)
+{
+	int ndim, nprotect = 0;
+	SEXPTYPE sink_Rtype, block_Rtype;
+	SEXP sink_dim;
+
+	sink_Rtype = TYPEOF(sink);
+	if (get_atomic_eltsize(sink_Rtype) == 0)
+		error("S4Arrays internal error in C_write_block_to_array():\n"
+		      "    type \"%s\" is not supported",
+		      type2char(sink_Rtype));
+	sink_dim = GET_DIM(sink);
+	if (sink_dim == R_NilValue)
+		error("'sink' must be an array");
+	ndim = LENGTH(sink_dim);
+	Subscript *subs = (Subscript *) R_alloc(ndim, sizeof(Subscript));
+	load_Nindex(Nindex, INTEGER(sink_dim), ndim, subs);
+	R_xlen_t *strides = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	R_xlen_t *idx = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	NindexPlan plan = make_Nindex_plan(INTEGER(sink_dim), ndim, subs,
+					   strides);
+
+	block_Rtype = TYPEOF(block);
+	if (!isVectorAtomic(block))
+		error("'block' must be an atomic vector or array");
+	if (XLENGTH(block) != plan.nelt)
+		error("'block' must have one element per array element "
+		      "selected by 'Nindex'");
+	if (block_Rtype != sink_Rtype &&
+	    !(plan.inner_is_run &&
+	      can_coerce_while_copying(sink_Rtype, block_Rtype)))
+	{
+		block = PROTECT(coerceVector(block, sink_Rtype));
+		nprotect++;
+		block_Rtype = sink_Rtype;
+	}
+	if (!LOGICAL(in_place)[0]) {
+		sink = PROTECT(duplicate(sink));
+		nprotect++;
+	}
+	copy_selection(&plan, (char *) get_atomic_dataptr(sink), sink_Rtype,
+		       (char *) get_atomic_dataptr(block), block_Rtype, 1, idx);
+	UNPROTECT(nprotect);
+	return sink;
+}
@@ -0,0 +1,11 @@
+#ifndef _NINDEX_UTILS_H_
+#define _NINDEX_UTILS_H_
+
+#include <Rdefines.h>
+
+SEXP C_subset_by_Nindex(SEXP x, SEXP Nindex);
+
+SEXP C_write_block_to_array(SEXP sink, SEXP Nindex, SEXP block,
+			    SEXP in_place);
+
+#endif  /* _NINDEX_UTILS_H_ */
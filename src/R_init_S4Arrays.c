@@ -1,28 +1,145 @@
 #include <R_ext/Rdynload.h>
 
+#include "thread_control.h"
+#include "instrumentation.h"
 #include "rowsum.h"
 #include "abind.h"
+#include "aperm2.h"
 #include "array_selection.h"
+#include "Nindex_utils.h"
+#include "ArrayGrid_utils.h"
+#include "mapToGrid.h"
+#include "gridOrder.h"
 #include "dim_tuning_utils.h"
 
-#define CALLMETHOD_DEF(fun, numArgs) {#fun, (DL_FUNC) &fun, numArgs}
+/* The instrumented .Call entry points (name, number of arguments). */
+#define INSTRUMENTED_CALLMETHODS					\
+/* thread_control.c */							\
+	X(C_get_num_procs, 0)						\
+									\
+/* rowsum.c */								\
+	X(C_rowsum, 5)							\
+	X(C_colsum, 5)							\
+	X(C_rowstats, 6)						\
+	X(C_colstats, 6)						\
+									\
+/* abind.c */								\
+	X(C_abind, 5)							\
+	X(C_abind_append, 3)						\
+									\
+/* aperm2.c */								\
+	X(C_aperm2, 3)							\
+									\
+/* array_selection.c */							\
+	X(C_Lindex2Mindex, 5)						\
+	X(C_Mindex2Lindex, 5)						\
+	X(C_Lindex2RLindex, 1)						\
+	X(C_RLindex2Lindex, 2)						\
+	X(C_RLindex2Mindex, 4)						\
+	X(C_Nindex2RLindex, 2)						\
+	X(C_subset_by_RLindex, 3)					\
+	X(C_subassign_by_RLindex, 4)					\
+									\
+/* Nindex_utils.c */							\
+	X(C_subset_by_Nindex, 2)					\
+	X(C_write_block_to_array, 4)					\
+									\
+/* ArrayGrid_utils.c */							\
+	X(C_get_ArrayGrid_dims, 1)					\
+	X(C_get_ArrayGrid_lengths, 1)					\
+	X(C_downsample_tickmarks, 2)					\
+									\
+/* mapToGrid.c */							\
+	X(C_mapToGrid_RegularArrayGrid, 4)				\
+	X(C_mapToGrid_ArbitraryArrayGrid, 3)				\
+	X(C_mapToRef_RegularArrayGrid, 5)				\
+	X(C_mapToRef_ArbitraryArrayGrid, 4)				\
+	X(C_bucketToGrid_RegularArrayGrid, 3)				\
+	X(C_bucketToGrid_ArbitraryArrayGrid, 2)				\
+									\
+/* gridOrder.c */							\
+	X(C_gridOrder, 2)						\
+									\
+/* dim_tuning_utils.c */						\
+	X(C_prepare_dim_tuner, 1)					\
+	X(C_tune_dims, 2)						\
+	X(C_tune_dimnames, 2)						\
+	X(C_tune_dims_batch, 2)
 
-static const R_CallMethodDef callMethods[] = {
 
-/* rowsum.c */
-	CALLMETHOD_DEF(C_rowsum, 4),
-	CALLMETHOD_DEF(C_colsum, 4),
+/****************************************************************************
+ * Instrumentation wrappers
+ *
+ * Each instrumented entry point 'fun' is registered as 'fun' but points to
+ * wrapper 'instrumented_fun'. When instrumentation is off, the wrapper costs
+ * a single test. Note that an entry point that raises an error doesn't get
+ * recorded.
+ */
+
+enum {
+#define X(fun, numArgs) ID_##fun,
+	INSTRUMENTED_CALLMETHODS
+#undef X
+	NUM_INSTRUMENTED_CALLMETHODS
+};
+
+static const char * const instrumented_callmethod_names[] = {
+#define X(fun, numArgs) #fun,
+	INSTRUMENTED_CALLMETHODS
+#undef X
+};
+
+#define PARAMS_0 void
+#define PARAMS_1 SEXP a1
+#define PARAMS_2 PARAMS_1, SEXP a2
+#define PARAMS_3 PARAMS_2, SEXP a3
+#define PARAMS_4 PARAMS_3, SEXP a4
+#define PARAMS_5 PARAMS_4, SEXP a5
+#define PARAMS_6 PARAMS_5, SEXP a6
+
+#define ARGS_0
+#define ARGS_1 a1
+#define ARGS_2 ARGS_1, a2
+#define ARGS_3 ARGS_2, a3
+#define ARGS_4 ARGS_3, a4
+#define ARGS_5 ARGS_4, a5
+#define ARGS_6 ARGS_5, a6
 
-/* abind.c */
-	CALLMETHOD_DEF(C_abind, 3),
+#define X(fun, numArgs)							\
+static SEXP instrumented_##fun(PARAMS_##numArgs)			\
+{									\
+	double t0;							\
+	SEXP ans;							\
+	if (!S4Arrays_instrumentation_enabled)				\
+		return fun(ARGS_##numArgs);				\
+	t0 = get_monotonic_time();					\
+	ans = fun(ARGS_##numArgs);					\
+	record_entry_point_call(ID_##fun, ans, t0);			\
+	return ans;							\
+}
+INSTRUMENTED_CALLMETHODS
+#undef X
+
+
+/****************************************************************************
+ * Registration
+ */
+
+#define CALLMETHOD_DEF(fun, numArgs) {#fun, (DL_FUNC) &fun, numArgs}
+
+static const R_CallMethodDef callMethods[] = {
 
-/* array_selection.c */
-	CALLMETHOD_DEF(C_Lindex2Mindex, 3),
-	CALLMETHOD_DEF(C_Mindex2Lindex, 4),
+#define X(fun, numArgs) \
+	{#fun, (DL_FUNC) &instrumented_##fun, numArgs},
+	INSTRUMENTED_CALLMETHODS
+#undef X
 
-/* dim_tuning_utils.c */
-	CALLMETHOD_DEF(C_tune_dims, 2),
-	CALLMETHOD_DEF(C_tune_dimnames, 2),
+/* instrumentation.c (not instrumented) */
+	CALLMETHOD_DEF(C_get_instrumentation, 0),
+	CALLMETHOD_DEF(C_set_instrumentation, 1),
+	CALLMETHOD_DEF(C_get_instrumentation_counters, 0),
+	CALLMETHOD_DEF(C_reset_instrumentation_counters, 0),
+	CALLMETHOD_DEF(C_monotonic_time, 0),
 
 	{NULL, NULL, 0}
 };
@@ -31,6 +148,9 @@ void R_init_S4Arrays(DllInfo *info)
 {
 	R_registerRoutines(info, NULL, callMethods, NULL, NULL);
 	R_useDynamicSymbols(info, 0);
+	init_rowsum_kernels();
+	init_instrumentation(instrumented_callmethod_names,
+			     NUM_INSTRUMENTED_CALLMETHODS);
 	return;
 }
 
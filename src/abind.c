@@ -1,9 +1,13 @@
 /****************************************************************************
- *                                C_abind()                                 *
+ *                      C_abind() and C_abind_append()                      *
  ****************************************************************************/
 #include "abind.h"
 
 #include "S4Vectors_interface.h"
+#include "atomic_utils.h"
+#include "thread_control.h"
+
+#include <string.h>  /* for memcpy() */
 
 
 /****************************************************************************
@@ -42,17 +46,69 @@ static long long int get_xnum_val(SEXP x, R_xlen_t i)
 }
 
 
+/****************************************************************************
+ * Copy blocks of an atomic vector to their place in the result
+ *
+ * For the atomic types that have a fixed-size element (i.e. all of them
+ * except STRSXP) we extract the data pointers once and copy the blocks
+ * with plain memcpy() (or coerce_block()). Since the blocks of a given
+ * object go to disjoint regions of the result, the range of blocks can
+ * be split across threads. The threads only deal with raw pointers and
+ * never call the R API.
+ */
+
+/* Copy blocks 'j1' to 'j2 - 1'. 'out' must point to the first element of
+   the first block in the result. The blocks are 'out_block_nelt' elements
+   apart in the result and contiguous in the input. */
+static void copy_atomic_blocks(char *out, SEXPTYPE out_type,
+		R_xlen_t out_block_nelt,
+		const char *in, SEXPTYPE in_type, R_xlen_t block_nelt,
+		R_xlen_t j1, R_xlen_t j2)
+{
+	size_t out_eltsize = get_atomic_eltsize(out_type);
+	size_t in_eltsize = get_atomic_eltsize(in_type);
+	size_t out_stride = out_eltsize * out_block_nelt;
+	size_t in_stride = in_eltsize * block_nelt;
+	out += out_stride * j1;
+	in += in_stride * j1;
+	if (in_type == out_type) {
+		for (R_xlen_t j = j1; j < j2; j++) {
+			memcpy(out, in, in_stride);
+			out += out_stride;
+			in += in_stride;
+		}
+	} else {
+		for (R_xlen_t j = j1; j < j2; j++) {
+			coerce_block(out, out_type, in, in_type, block_nelt);
+			out += out_stride;
+			in += in_stride;
+		}
+	}
+	return;
+}
+
+
 /****************************************************************************
  * C_abind()
  */
 
+/* 'ans_type' must be the type of the result i.e. the "highest" type of
+   all the objects to bind. Objects that have a different type are converted
+   to 'ans_type' as they are copied, except for the conversions not supported
+   by coerce_block(). Objects that need one of those are coerced with
+   coerceVector() one at a time, so at most one temporary copy exists at
+   any given time.
+   When the result is an atomic vector other than a character vector,
+   the blocks of each object are copied by 'nthread' threads. */
+
 /* --- .Call ENTRY POINT --- */
-SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim)
+SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim, SEXP ans_type,
+	     SEXP nthread)
 {
-	int nobject;
+	int nobject, nthread0, coerce_on_copy, nchunk, k;
 	long long int nblock0, i, j, ans_offset, ans_block_nelt, block_nelt;
 	R_xlen_t object_len, ans_len;
-	SEXPTYPE ans_type;
+	SEXPTYPE ans_Rtype, object_Rtype;
 	SEXP object, ans, dim;
 
 	if (!isVectorList(objects))  // IS_LIST() is broken
@@ -65,17 +121,18 @@ SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim)
 	nblock0 = get_xnum_val(nblock, 0);
 	if (nblock0 <= 0)
 		error("'nblock' must be > 0");
+	if (!IS_CHARACTER(ans_type) || LENGTH(ans_type) != 1 ||
+	    STRING_ELT(ans_type, 0) == NA_STRING)
+		error("'ans_type' must be a single string");
+	ans_Rtype = str2type(CHAR(STRING_ELT(ans_type, 0)));
+	if (ans_Rtype == (SEXPTYPE) -1)
+		error("invalid 'ans_type' value");
+	nthread0 = get_nthread(nthread);
 
-	/* Determine 'ans_len' and 'ans_type'. */
-	ans_type = NILSXP;  // avoid gcc maybe-uninitialized warning
+	/* Determine 'ans_len'. */
 	ans_len = 0;
 	for (i = 0; i < nobject; i++) {
 		object = VECTOR_ELT(objects, i);
-		if (i == 0) {
-			ans_type = TYPEOF(object);
-		} else if (TYPEOF(object) != ans_type) {
-			error("the arrays to bind must have the same type");
-		}
 		object_len = XLENGTH(object);
 		if (object_len % nblock0 != 0)
 			error("the arrays to bind must have a length that "
@@ -85,17 +142,46 @@ SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim)
 	ans_block_nelt = ans_len / nblock0;
 
 	/* Alloc and fill 'ans'. */
-	ans = PROTECT(allocVector(ans_type, ans_len));
+	ans = PROTECT(allocVector(ans_Rtype, ans_len));
+	size_t ans_eltsize = get_atomic_eltsize(ans_Rtype);
+	char *ans_p = (char *) get_atomic_dataptr(ans);
 	ans_offset = 0;
 	for (i = 0; i < nobject; i++) {
 		object = VECTOR_ELT(objects, i);
+		object_Rtype = TYPEOF(object);
+		coerce_on_copy = 0;
+		if (object_Rtype != ans_Rtype) {
+			if (can_coerce_while_copying(ans_Rtype, object_Rtype))
+				coerce_on_copy = 1;
+			else
+				object = PROTECT(coerceVector(object,
+							      ans_Rtype));
+		}
 		object_len = XLENGTH(object);
 		block_nelt = object_len / nblock0;
-		for (j = 0; j < nblock0; j++) {
-			copy_vector_block(ans, ans_offset + j * ans_block_nelt,
-				object, j * block_nelt,
-				block_nelt);
+		if (ans_p != NULL && block_nelt != 0) {
+			char *out_p = ans_p + ans_eltsize * ans_offset;
+			const char *in_p =
+				(const char *) get_atomic_dataptr(object);
+			SEXPTYPE in_Rtype = TYPEOF(object);
+			nchunk = compute_nchunk(nthread0, nblock0, object_len);
+			#pragma omp parallel for num_threads(nchunk) \
+				schedule(static)
+			for (k = 0; k < nchunk; k++)
+				copy_atomic_blocks(out_p, ans_Rtype,
+					ans_block_nelt,
+					in_p, in_Rtype, block_nelt,
+					CHUNK_START(k, nblock0, nchunk),
+					CHUNK_START(k + 1, nblock0, nchunk));
+		} else {
+			for (j = 0; j < nblock0; j++)
+				copy_vector_block(ans,
+					ans_offset + j * ans_block_nelt,
+					object, j * block_nelt,
+					block_nelt);
 		}
+		if (object_Rtype != ans_Rtype && !coerce_on_copy)
+			UNPROTECT(1);
 		ans_offset += block_nelt;
 	}
 
@@ -106,3 +192,49 @@ SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim)
 	return ans;
 }
 
+
+/****************************************************************************
+ * C_abind_append()
+ *
+ * Helper for the abind accumulator defined in R/abind-accumulator.R.
+ * Copy 'object' to 'buffer' starting at 'offset' (0-based), converting
+ * 'object' to the type of 'buffer' on the fly if needed.
+ * WARNING: 'buffer' is modified in place! This is only safe because the
+ * accumulator owns 'buffer' and never exposes it before finalization.
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_abind_append(SEXP buffer, SEXP offset, SEXP object)
+{
+	long long int offset0;
+	R_xlen_t object_len;
+	SEXPTYPE buffer_Rtype, object_Rtype;
+
+	if (get_xnum_length(offset) != 1)
+		error("'offset' must be a single number");
+	offset0 = get_xnum_val(offset, 0);
+	object_len = XLENGTH(object);
+	if (offset0 < 0 || offset0 > XLENGTH(buffer) - object_len)
+		error("S4Arrays internal error in C_abind_append():\n"
+		      "    not enough space in 'buffer'");
+	if (object_len == 0)
+		return R_NilValue;
+	buffer_Rtype = TYPEOF(buffer);
+	object_Rtype = TYPEOF(object);
+	if (object_Rtype == buffer_Rtype) {
+		copy_vector_block(buffer, offset0, object, 0, object_len);
+		return R_NilValue;
+	}
+	if (can_coerce_while_copying(buffer_Rtype, object_Rtype)) {
+		char *out_p = (char *) get_atomic_dataptr(buffer) +
+			      get_atomic_eltsize(buffer_Rtype) * offset0;
+		coerce_block(out_p, buffer_Rtype,
+			     get_atomic_dataptr(object), object_Rtype,
+			     object_len);
+		return R_NilValue;
+	}
+	object = PROTECT(coerceVector(object, buffer_Rtype));
+	copy_vector_block(buffer, offset0, object, 0, object_len);
+	UNPROTECT(1);
+	return R_NilValue;
+}
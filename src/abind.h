@@ -3,7 +3,10 @@
 
 #include <Rdefines.h>
 
-SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim);
+SEXP C_abind(SEXP objects, SEXP nblock, SEXP ans_dim, SEXP ans_type,
+	     SEXP nthread);
+
+SEXP C_abind_append(SEXP buffer, SEXP offset, SEXP object);
 
 #endif  /* _ABIND_H_ */
 
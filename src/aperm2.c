@@ -0,0 +1,342 @@
+/****************************************************************************
+ *                                C_aperm2()                                *
+ ****************************************************************************/
+#include "aperm2.h"
+
+#include "thread_control.h"
+
+#include <string.h>  /* for memcpy() */
+
+
+/****************************************************************************
+ * Simplification of the permutation
+ *
+ * C_aperm2() accepts the "extended" permutation vectors used by aperm2()
+ * i.e. permutation vectors that can drop some ineffective dimensions of
+ * the input (dimensions not in 'perm') and/or add ineffective dimensions
+ * to the output (NAs in 'perm'). This is the same information as the
+ * 'dim_tuner' vectors described in dim_tuning_utils.c, plus the actual
+ * permutation of the dimensions that are kept. Since ineffective dimensions
+ * don't affect the memory layout of an array, the kernels below simply
+ * ignore them, so permuting and tuning the dimensions happen in a single
+ * pass.
+ *
+ * The kernels work on a simplified version of the permutation where:
+ *   - All the dimensions with an extent of 1 are removed (including those
+ *     that are kept).
+ *   - Consecutive output dimensions that map to consecutive input
+ *     dimensions are merged into a single dimension.
+ * For example, permuting a 10 x 1 x 20 x 30 array with 'perm=c(3, 4, 1)'
+ * is the same as transposing a 10 x 600 matrix.
+ * After simplification, the permutation is described by the extents of
+ * the output dimensions 'ext[k]', and their strides in the input and in
+ * the output, 'in_stride[k]' and 'out_stride[k]'.
+ */
+
+typedef struct axis_plan_t {
+	int ndim;
+	R_xlen_t *ext;
+	R_xlen_t *in_stride;
+	R_xlen_t *out_stride;
+	int *loop_order;
+} AxisPlan;
+
+/* 'perm' must contain 1-based indices into 'a_dim' or NAs. It's assumed to
+   have been validated at the R level with validate_perm(). */
+static AxisPlan make_axis_plan(const int *a_dim, int a_ndim,
+		const int *perm, int perm_len)
+{
+	AxisPlan plan;
+	R_xlen_t *a_stride;
+	int along, k, m;
+
+	a_stride = (R_xlen_t *) R_alloc(a_ndim, sizeof(R_xlen_t));
+	for (along = 0; along < a_ndim; along++)
+		a_stride[along] = along == 0 ? 1 :
+				  a_stride[along - 1] * a_dim[along - 1];
+	plan.ext = (R_xlen_t *) R_alloc(perm_len, sizeof(R_xlen_t));
+	plan.in_stride = (R_xlen_t *) R_alloc(perm_len, sizeof(R_xlen_t));
+	plan.out_stride = (R_xlen_t *) R_alloc(perm_len, sizeof(R_xlen_t));
+	m = 0;
+	int prev_along = -1;  /* last input dim that was merged */
+	for (k = 0; k < perm_len; k++) {
+		if (perm[k] == NA_INTEGER)
+			continue;
+		along = perm[k] - 1;
+		if (along < 0 || along >= a_ndim)
+			error("S4Arrays internal error in make_axis_plan():\n"
+			      "    'perm' contains out of bound values");
+		if (a_dim[along] == 1)
+			continue;
+		/* Input dims 'prev_along + 1' to 'along - 1' all have an
+		   extent of 1 if 'along' comes right after 'prev_along' in
+		   the input once we ignore ineffective dims. */
+		int merge = m != 0 && along > prev_along;
+		for (int i = prev_along + 1; merge && i < along; i++)
+			if (a_dim[i] != 1)
+				merge = 0;
+		if (merge) {
+			plan.ext[m - 1] *= a_dim[along];
+		} else {
+			plan.ext[m] = a_dim[along];
+			plan.in_stride[m] = a_stride[along];
+			m++;
+		}
+		prev_along = along;
+	}
+	for (k = 0; k < m; k++)
+		plan.out_stride[k] = k == 0 ? 1 :
+			plan.out_stride[k - 1] * plan.ext[k - 1];
+	plan.ndim = m;
+
+	/* The loops of the kernels walk on output dim 0 first (innermost
+	   loop), then on the output dim that is contiguous in the input,
+	   then on the remaining output dims. */
+	plan.loop_order = (int *) R_alloc(perm_len + 1, sizeof(int));
+	plan.loop_order[0] = 0;
+	int r = 0;
+	for (k = 0; k < m; k++)
+		if (plan.in_stride[k] == 1)
+			r = k;
+	m = 1;
+	if (r != 0)
+		plan.loop_order[m++] = r;
+	for (k = 1; k < plan.ndim; k++)
+		if (k != r)
+			plan.loop_order[m++] = k;
+	return plan;
+}
+
+
+/****************************************************************************
+ * The kernels
+ *
+ * After simplification, 3 situations are possible:
+ *   1. The permutation has 0 or 1 dimension: the data is copied as-is.
+ *   2. The permutation has 2 dimensions: it's a matrix transposition.
+ *      We use a blocked transposition with square tiles of TILE x TILE
+ *      elements so that the tile being read and the tile being written to
+ *      both stay in L1.
+ *   3. The permutation has 3 or more dimensions: if output dim 0 is
+ *      contiguous in the input (i.e. the permutation moves blocks of
+ *      contiguous elements), the blocks are copied in output order.
+ *      Otherwise this is a batch of transpositions between output dim 0
+ *      and the output dim that is contiguous in the input (dim 'r'). We
+ *      use a recursive cache-oblivious scheme where the box to copy is cut
+ *      in 2 halves along the longest of these 2 dims until both are no
+ *      longer than TILE. Then the leaf box is copied with the innermost
+ *      loop walking on output dim 0 (so the writes are sequential), the
+ *      next loop walking on dim 'r' (so the input cache lines get reused),
+ *      and the outer loops walking on the remaining dims.
+ *
+ * Multithreading is done by splitting the output along its slowest
+ * varying dimension (after simplification), so each thread writes to its
+ * own region of the output.
+ */
+
+#define	TILE 32
+
+/* #pragma cannot be used inside a macro definition. */
+#define	OMP_PARALLEL_FOR_NCHUNK \
+	_Pragma("omp parallel for num_threads(nchunk) schedule(static)")
+
+#define	DEFINE_APERM_KERNELS(suffix, type)				\
+									\
+static void transpose_ ## suffix(const type *in, type *out,		\
+		R_xlen_t nrow, R_xlen_t ncol,				\
+		R_xlen_t row1, R_xlen_t row2)				\
+{									\
+	/* 'in' is 'nrow' x 'ncol' and 'out' is 'ncol' x 'nrow'.	\
+	   Only rows 'row1' to 'row2 - 1' of 'in' (i.e. columns 'row1'	\
+	   to 'row2 - 1' of 'out') are transposed. */			\
+	for (R_xlen_t i0 = row1; i0 < row2; i0 += TILE) {		\
+		R_xlen_t i1 = i0 + TILE < row2 ? i0 + TILE : row2;	\
+		for (R_xlen_t j0 = 0; j0 < ncol; j0 += TILE) {		\
+			R_xlen_t j1 = j0 + TILE < ncol ? j0 + TILE : ncol;\
+			for (R_xlen_t i = i0; i < i1; i++) {		\
+				type *out_p = out + i * ncol;		\
+				const type *in_p = in + i;		\
+				for (R_xlen_t j = j0; j < j1; j++)	\
+					out_p[j] = in_p[j * nrow];	\
+			}						\
+		}							\
+	}								\
+	return;								\
+}									\
+									\
+static void aperm_leaf_ ## suffix(const type *in, type *out,		\
+		const AxisPlan *plan, const R_xlen_t *lo,		\
+		const R_xlen_t *hi, R_xlen_t *idx)			\
+{									\
+	int m = plan->ndim, k, along;					\
+	const int *order = plan->loop_order;				\
+	R_xlen_t in_off = 0, out_off = 0;				\
+	for (k = 0; k < m; k++) {					\
+		idx[k] = lo[k];						\
+		in_off += lo[k] * plan->in_stride[k];			\
+		out_off += lo[k] * plan->out_stride[k];			\
+	}								\
+	R_xlen_t n0 = hi[0] - lo[0], s0 = plan->in_stride[0];		\
+	while (1) {							\
+		const type *in_p = in + in_off;				\
+		type *out_p = out + out_off;				\
+		for (R_xlen_t i = 0; i < n0; i++)			\
+			out_p[i] = in_p[i * s0];			\
+		/* Move to the next row of the leaf box. */		\
+		for (k = 1; k < m; k++) {				\
+			along = order[k];				\
+			idx[along]++;					\
+			in_off += plan->in_stride[along];		\
+			out_off += plan->out_stride[along];		\
+			if (idx[along] < hi[along])			\
+				break;					\
+			R_xlen_t n = hi[along] - lo[along];		\
+			in_off -= n * plan->in_stride[along];		\
+			out_off -= n * plan->out_stride[along];		\
+			idx[along] = lo[along];				\
+		}							\
+		if (k == m)						\
+			return;						\
+	}								\
+}									\
+									\
+static void aperm_rec_ ## suffix(const type *in, type *out,		\
+		const AxisPlan *plan, R_xlen_t *lo, R_xlen_t *hi,	\
+		R_xlen_t *idx)						\
+{									\
+	int r = plan->loop_order[1];					\
+	R_xlen_t n0 = hi[0] - lo[0], nr = hi[r] - lo[r];		\
+	if (plan->in_stride[0] == 1 || (n0 <= TILE && nr <= TILE)) {	\
+		aperm_leaf_ ## suffix(in, out, plan, lo, hi, idx);	\
+		return;							\
+	}								\
+	int along = n0 >= nr ? 0 : r;					\
+	R_xlen_t lo0 = lo[along], hi0 = hi[along];			\
+	R_xlen_t mid = lo0 + (hi0 - lo0) / 2;				\
+	hi[along] = mid;						\
+	aperm_rec_ ## suffix(in, out, plan, lo, hi, idx);		\
+	hi[along] = hi0;						\
+	lo[along] = mid;						\
+	aperm_rec_ ## suffix(in, out, plan, lo, hi, idx);		\
+	lo[along] = lo0;						\
+	return;								\
+}									\
+									\
+static void aperm_ ## suffix(const type *in, type *out, R_xlen_t len,	\
+		const AxisPlan *plan, int nthread)			\
+{									\
+	int m = plan->ndim, nchunk, k;					\
+	if (m <= 1) {							\
+		nchunk = compute_nchunk(nthread, len, len);		\
+		OMP_PARALLEL_FOR_NCHUNK					\
+		for (k = 0; k < nchunk; k++) {				\
+			R_xlen_t i1 = CHUNK_START(k, len, nchunk);	\
+			R_xlen_t i2 = CHUNK_START(k + 1, len, nchunk);	\
+			memcpy(out + i1, in + i1, sizeof(type) * (i2 - i1));\
+		}							\
+		return;							\
+	}								\
+	R_xlen_t n = plan->ext[m - 1];					\
+	nchunk = compute_nchunk(nthread, n, len);			\
+	if (m == 2) {							\
+		/* The input dims must be in reverse order, otherwise	\
+		   they would have been merged. */			\
+		OMP_PARALLEL_FOR_NCHUNK					\
+		for (k = 0; k < nchunk; k++)				\
+			transpose_ ## suffix(in, out,			\
+				plan->ext[1], plan->ext[0],		\
+				CHUNK_START(k, n, nchunk),		\
+				CHUNK_START(k + 1, n, nchunk));		\
+		return;							\
+	}								\
+	/* Each thread needs its own 'lo', 'hi', and 'idx' buffers. */	\
+	R_xlen_t *bufs = (R_xlen_t *)					\
+		R_alloc((size_t) 3 * m * nchunk, sizeof(R_xlen_t));	\
+	OMP_PARALLEL_FOR_NCHUNK						\
+	for (k = 0; k < nchunk; k++) {					\
+		R_xlen_t *lo = bufs + (size_t) 3 * m * k;		\
+		R_xlen_t *hi = lo + m, *idx = hi + m;			\
+		for (int along = 0; along < m; along++) {		\
+			lo[along] = 0;					\
+			hi[along] = plan->ext[along];			\
+		}							\
+		lo[m - 1] = CHUNK_START(k, n, nchunk);			\
+		hi[m - 1] = CHUNK_START(k + 1, n, nchunk);		\
+		aperm_rec_ ## suffix(in, out, plan, lo, hi, idx);	\
+	}								\
+	return;								\
+}
+
+DEFINE_APERM_KERNELS(Rbyte, Rbyte)
+DEFINE_APERM_KERNELS(int, int)
+DEFINE_APERM_KERNELS(double, double)
+DEFINE_APERM_KERNELS(Rcomplex, Rcomplex)
+
+
+/****************************************************************************
+ * C_aperm2()
+ */
+
+/* --- .Call ENTRY POINT ---
+   Permute the dimensions of ordinary array 'a' of type logical, integer,
+   double, complex, or raw. 'perm' must be an "extended" permutation vector
+   as accepted by aperm2(). Unlike base::aperm(), the dimnames are
+   ignored (they're taken care of at the R level). */
+SEXP C_aperm2(SEXP a, SEXP perm, SEXP nthread)
+{
+	SEXP a_dim, ans, ans_dim;
+	int a_ndim, perm_len, nthread0, k;
+	const int *perm_p;
+	R_xlen_t a_len;
+
+	a_dim = GET_DIM(a);
+	if (a_dim == R_NilValue)
+		error("'a' must be an array");
+	a_ndim = LENGTH(a_dim);
+	if (!IS_INTEGER(perm))
+		error("'perm' must be an integer vector");
+	perm_len = LENGTH(perm);
+	perm_p = INTEGER(perm);
+	a_len = XLENGTH(a);
+	nthread0 = get_nthread(nthread);
+
+	AxisPlan plan = make_axis_plan(INTEGER(a_dim), a_ndim,
+				       perm_p, perm_len);
+
+	ans = PROTECT(allocVector(TYPEOF(a), a_len));
+	ans_dim = PROTECT(NEW_INTEGER(perm_len));
+	for (k = 0; k < perm_len; k++)
+		INTEGER(ans_dim)[k] = perm_p[k] == NA_INTEGER ? 1 :
+				      INTEGER(a_dim)[perm_p[k] - 1];
+	SET_DIM(ans, ans_dim);
+	/* The kernels don't expect any extent to be 0 (e.g. the leaves of
+	   aperm_rec_*() would still write 'n0' elements per row). */
+	if (a_len == 0) {
+		UNPROTECT(2);
+		return ans;
+	}
+	switch (TYPEOF(a)) {
+	    case LGLSXP:
+		aperm_int(LOGICAL(a), LOGICAL(ans), a_len, &plan, nthread0);
+		break;
+	    case INTSXP:
+		aperm_int(INTEGER(a), INTEGER(ans), a_len, &plan, nthread0);
+		break;
+	    case REALSXP:
+		aperm_double(REAL(a), REAL(ans), a_len, &plan, nthread0);
+		break;
+	    case CPLXSXP:
+		aperm_Rcomplex(COMPLEX(a), COMPLEX(ans), a_len, &plan,
+			       nthread0);
+		break;
+	    case RAWSXP:
+		aperm_Rbyte(RAW(a), RAW(ans), a_len, &plan, nthread0);
+		break;
+	    default:
+		error("S4Arrays internal error in C_aperm2():\n"
+		      "    type \"%s\" is not supported", type2char(TYPEOF(a)));
+	}
+
+	UNPROTECT(2);
+	return ans;
+}
@@ -0,0 +1,8 @@
+#ifndef _APERM2_H_
+#define _APERM2_H_
+
+#include <Rdefines.h>
+
+SEXP C_aperm2(SEXP a, SEXP perm, SEXP nthread);
+
+#endif  /* _APERM2_H_ */
@@ -4,8 +4,10 @@
 #include "array_selection.h"
 
 #include "S4Vectors_interface.h"
+#include "thread_control.h"
 
 #include <limits.h>  /* for INT_MAX, LLONG_MAX, LLONG_MIN */
+#include <math.h>    /* for trunc() */
 
 /*
   An array selection is just an index into an array-like object that defines
@@ -84,47 +86,70 @@
          Nindex <- S4Arrays:::normalize_Nindex(Nindex, a)
          ## Same as a[c("D", "B"), , 1, drop=FALSE]:
          S4Arrays:::subset_by_Nindex(a, Nindex)
+
+  4. Run-length linear index (also called "RL-index"): An IntegerRanges
+     derivative (e.g. an IRanges object) where each range represents a run
+     of consecutive L-index values. This is a compact representation of a
+     sorted selection that contains long contiguous runs. When using an
+     RL-index to subset an array-like object, the returned value is the
+     same as when using the equivalent L-index.
+
+       Example:
+         a <- array(101:124, 4:2)
+         RLindex <- IRanges(c(2, 15), c(7, 20))
+         S4Arrays:::subset_by_RLindex(a, RLindex)
 */
 
 #define ERRMSG_BUF_LENGTH 256
 
-static char *errmsg_buf()
-{
-	static char buf[ERRMSG_BUF_LENGTH];
-
-	return buf;
-}
+/* The functions that walk on the L-index or M-index are called from
+   multiple threads so they cannot call error(). Instead they record the
+   first problem they encounter in their own ErrState struct and return -1.
+   The caller's thread then raises the error for the failing row with the
+   lowest index, so the error message doesn't depend on the number of
+   threads. */
+typedef struct errstate_t {
+	R_xlen_t row;  /* 0-based index of the failing row */
+	char msg[ERRMSG_BUF_LENGTH];
+} ErrState;
 
-#define PRINT_TO_ERRMSG_BUF(...) \
-	snprintf(errmsg_buf(), ERRMSG_BUF_LENGTH, __VA_ARGS__)
+#define PRINT_TO_ERRSTATE(errstate, i, ...) \
+	((errstate)->row = (i), \
+	 snprintf((errstate)->msg, ERRMSG_BUF_LENGTH, __VA_ARGS__))
 
 #define NOT_A_FINITE_NUMBER(x) \
 	(R_IsNA(x) || R_IsNaN(x) || (x) == R_PosInf || (x) == R_NegInf)
 
-static inline int get_untrusted_elt(SEXP x, int i, long long int *val,
-				    const char *what)
+/* One of 'x_int' or 'x_dbl' must be NULL. */
+static inline int get_untrusted_elt(const int *x_int, const double *x_dbl,
+				    R_xlen_t i, long long int *val,
+				    const char *what, ErrState *errstate)
 {
 	int tmp1;
 	double tmp2;
 
-	if (IS_INTEGER(x)) {
-		tmp1 = INTEGER(x)[i];
+	if (x_int != NULL) {
+		tmp1 = x_int[i];
 		if (tmp1 == NA_INTEGER) {
-			PRINT_TO_ERRMSG_BUF("%s[%d] is NA", what, i + 1);
+			PRINT_TO_ERRSTATE(errstate, i,
+					  "%s[%lld] is NA", what,
+					  (long long int) i + 1);
 			return -1;
 		}
 		*val = (long long int) tmp1;
 	} else {
-		tmp2 = REAL(x)[i];
+		tmp2 = x_dbl[i];
 		if (NOT_A_FINITE_NUMBER(tmp2)) {
-			PRINT_TO_ERRMSG_BUF("%s[%d] is NA or NaN "
-					    "or not a finite number",
-					    what, i + 1);
+			PRINT_TO_ERRSTATE(errstate, i,
+					  "%s[%lld] is NA or NaN "
+					  "or not a finite number",
+					  what, (long long int) i + 1);
 			return -1;
 		}
 		if (tmp2 > (double) LLONG_MAX || tmp2 < (double) LLONG_MIN) {
-			PRINT_TO_ERRMSG_BUF("%s[%d] is too large (= %e)",
-					    what, i + 1, tmp2);
+			PRINT_TO_ERRSTATE(errstate, i,
+					  "%s[%lld] is too large (= %e)",
+					  what, (long long int) i + 1, tmp2);
 			return -1;
 		}
 		*val = (long long int) tmp2;
@@ -132,6 +157,29 @@ static inline int get_untrusted_elt(SEXP x, int i, long long int *val,
 	return 0;
 }
 
+/* Thread-safe versions of S4Vectors' safe_llint_mult() and
+   safe_llint_add() for non-negative operands. They set '*ovflow' to 1
+   instead of setting the global overflow flag. */
+static inline long long int nonneg_llint_mult(long long int x,
+		long long int y, int *ovflow)
+{
+	if (y != 0 && x > LLONG_MAX / y) {
+		*ovflow = 1;
+		return 0;
+	}
+	return x * y;
+}
+
+static inline long long int nonneg_llint_add(long long int x,
+		long long int y, int *ovflow)
+{
+	if (x > LLONG_MAX - y) {
+		*ovflow = 1;
+		return 0;
+	}
+	return x + y;
+}
+
 static int get_matrix_nrow_ncol(SEXP m, int *nrow, int *ncol)
 {
 	SEXP m_dim;
@@ -205,68 +253,85 @@ static void set_rownames(SEXP m, SEXP rownames)
 
 /****************************************************************************
  * Convert back and forth between L-index and M-index
+ *
+ * All the functions below process rows 'i1' to 'i2 - 1' of the L-index
+ * or M-index so the rows can be split across threads. They only deal with
+ * raw pointers and never call the R API.
+ *
+ * L2M() and L2M_fast() write the M-index via 'M_cols', an array of 'ndim'
+ * pointers to the first element of each column of the M-index. This allows
+ * them to fill an ordinary M-index (i.e. an integer matrix) or an M-index
+ * returned as a list of integer vectors. The latter can be long.
  */
 
-static int L2M(const int *dim, int ndim, int dim_nrow, SEXP L, int *M)
+static int L2M(const int *dim, int ndim, int dim_nrow,
+	       const int *L_int, const double *L_dbl,
+	       R_xlen_t i1, R_xlen_t i2, int *const *M_cols,
+	       ErrState *errstate)
 {
-	int M_nrow, i, ret, along, d;
+	int ret, along, d;
 	long long int x;
-	R_xlen_t dim_off, M_off;
+	R_xlen_t i, dim_off;
 
-	M_nrow = LENGTH(L);
-	for (i = 0; i < M_nrow; i++) {
-		ret = get_untrusted_elt(L, i, &x, "Lindex");
+	for (i = i1; i < i2; i++) {
+		ret = get_untrusted_elt(L_int, L_dbl, i, &x, "Lindex",
+					errstate);
 		if (ret < 0)
 			return -1;
 		if (x < 1) {
-			PRINT_TO_ERRMSG_BUF("Lindex[%d] is < 1", i + 1);
+			PRINT_TO_ERRSTATE(errstate, i,
+					  "Lindex[%lld] is < 1",
+					  (long long int) i + 1);
 			return -1;
 		}
 		x--;
 		dim_off = 0;
 		if (dim_nrow != 1)
 			dim_off += i;
-		M_off = i;
 		for (along = 0; along < ndim; along++) {
 			d = dim[dim_off];
 			if (d == NA_INTEGER || d < 0) {
-				PRINT_TO_ERRMSG_BUF("'dim' cannot contain NAs "
-						    "or negative values");
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "'dim' cannot contain NAs "
+						  "or negative values");
 				return -1;
 			}
 			if (d == 0) {
-				PRINT_TO_ERRMSG_BUF("'dim' cannot contain "
-						    "zeros (unless 'Lindex' "
-						    "is empty)");
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "'dim' cannot contain "
+						  "zeros (unless 'Lindex' "
+						  "is empty)");
 				return -1;
 			}
-			M[M_off] = x % d + 1;
+			M_cols[along][i] = x % d + 1;
 			x /= d;
 			dim_off += dim_nrow;
-			M_off += M_nrow;
 		}
 		if (x != 0) {
-			PRINT_TO_ERRMSG_BUF("Lindex[%d] is > prod(dim)", i + 1);
+			PRINT_TO_ERRSTATE(errstate, i,
+					  "Lindex[%lld] is > prod(dim)",
+					  (long long int) i + 1);
 			return -1;
 		}
 	}
 	return 0;
 }
 
+/* One of 'L_int' or 'L_dbl' must be NULL. */
 static int M2L(const int *dim, int ndim, int dim_nrow,
-	       const int *M, int M_nrow, SEXP L)
+	       const int *M, int M_nrow, int *L_int, double *L_dbl,
+	       int i1, int i2, ErrState *errstate)
 {
 	R_xlen_t dim_len, M_len, dim_off, M_off;
-	int i, along, m, d;
+	int i, along, m, d, ovflow;
 	long long int x;
 	double val;
 
-	dim_len = dim_nrow * ndim;
-	M_len = M_nrow * ndim;
-	if (TYPEOF(L) != INTSXP)
-		reset_ovflow_flag();
-	for (i = 0; i < M_nrow; i++) {
+	dim_len = (R_xlen_t) dim_nrow * ndim;
+	M_len = (R_xlen_t) M_nrow * ndim;
+	for (i = i1; i < i2; i++) {
 		x = 0;
+		ovflow = 0;
 		dim_off = dim_len;
 		if (dim_nrow != 1)
 			dim_off += i;
@@ -276,55 +341,252 @@ static int M2L(const int *dim, int ndim, int dim_nrow,
 			M_off -= M_nrow;
 			d = dim[dim_off];
 			if (d == NA_INTEGER || d < 0) {
-				PRINT_TO_ERRMSG_BUF("'dim' cannot contain NAs "
-						    "or negative values");
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "'dim' cannot contain NAs "
+						  "or negative values");
 				return -1;
 			}
 			if (d == 0) {
-				PRINT_TO_ERRMSG_BUF("'dim' cannot contain "
-						    "zeros (unless 'Mindex' "
-						    "is empty)");
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "'dim' cannot contain "
+						  "zeros (unless 'Mindex' "
+						  "is empty)");
 				return -1;
 			}
 			m = M[M_off];
 			if (INVALID_COORD(m, d)) {
-				PRINT_TO_ERRMSG_BUF("Mindex[%d, %d] is NA "
-						    "or < 1 or > dim[%d]",
-						    i + 1, along + 1,
-						    along + 1);
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "Mindex[%d, %d] is NA "
+						  "or < 1 or > dim[%d]",
+						  i + 1, along + 1,
+						  along + 1);
 				return -1;
 			}
-			if (TYPEOF(L) == INTSXP) {
+			if (L_int != NULL) {
 				x *= d;
 				x += m - 1;
 			} else {
-				x = safe_llint_mult(x, (long long int) d);
-				x = safe_llint_add(x, (long long int) m - 1);
+				x = nonneg_llint_mult(x, (long long int) d,
+						      &ovflow);
+				x = nonneg_llint_add(x, (long long int) m - 1,
+						     &ovflow);
 			}
 		}
-		if (TYPEOF(L) == INTSXP) {
+		if (L_int != NULL) {
 			x++;
-			INTEGER(L)[i] = (int) x;
+			L_int[i] = (int) x;
 		} else {
-			x = safe_llint_add(x, 1);
+			x = nonneg_llint_add(x, 1, &ovflow);
 			val = (double) x;
-			if (get_ovflow_flag() || (long long int) val != x) {
-				PRINT_TO_ERRMSG_BUF("dimensions in dim[%d, ] "
-						    "are too big", i + 1);
+			if (ovflow || (long long int) val != x) {
+				PRINT_TO_ERRSTATE(errstate, i,
+						  "dimensions in dim[%d, ] "
+						  "are too big", i + 1);
 				return -1;
 			}
-			REAL(L)[i] = val;
+			L_dbl[i] = val;
+		}
+	}
+	return 0;
+}
+
+/* Fast paths for when 'dim' has a single row and all the L-index values
+   are guaranteed to fit exactly in a double (we use prod(dim) <= 2^51).
+   The dims are validated once, and the loops walk on the M-index one
+   column at a time so they are branch-free and vectorizable:
+     - L2M_fast() replaces the integer division by d with a multiplication
+       by the precomputed reciprocal 1/d, rounded to the nearest integer,
+       followed by a one-step correction. The error of the rounded value
+       is at most 1 with these magnitudes. This is the floating-point
+       counterpart of the invariant-divisor trick used by libdivide.
+     - M2L_fast() accumulates (m - 1) * stride[along] into the result.
+   Both return -1 if they don't apply or if the input contains invalid
+   values. In that case the caller must fall back to L2M() or M2L(), which
+   will report the problem (with the same error message as before). */
+
+#define	MAX_FAST_DIM_PROD 2251799813685248LL  /* 2^51 */
+
+/* Return -1 if 'dim' contains NAs, negative values, or zeros, or if
+   prod(dim) > MAX_FAST_DIM_PROD. */
+static long long int get_fast_dim_prod(const int *dim, int ndim)
+{
+	long long int prod = 1;
+
+	for (int along = 0; along < ndim; along++) {
+		int d = dim[along];
+		if (d == NA_INTEGER || d <= 0)
+			return -1;
+		prod *= d;
+		if (prod > MAX_FAST_DIM_PROD)
+			return -1;
+	}
+	return prod;
+}
+
+/* Number of L-index values processed at a time by L2M_fast(). */
+#define	L2M_BLOCK_SIZE 1024
+
+/* Adding and subtracting 1.5 * 2^52 rounds a double in [-2^51, 2^51] to
+   the nearest integer without calling floor() or rint() (which are not
+   inlined without SSE4.1 so would prevent vectorization). */
+#define	ROUNDING_MAGIC 6755399441055744.0  /* 1.5 * 2^52 */
+
+/* 'prod' must be the value returned by get_fast_dim_prod(). */
+static int L2M_fast(const int *dim, int ndim, long long int prod,
+		    const int *L_int, const double *L_dbl,
+		    R_xlen_t i1, R_xlen_t i2, int *const *M_cols)
+{
+	R_xlen_t i, i0;
+	int k, n, along, bad;
+	double x[L2M_BLOCK_SIZE];
+
+	/* Check the L-index values first. */
+	bad = 0;
+	if (L_int != NULL) {
+		#pragma omp simd reduction(|:bad)
+		for (i = i1; i < i2; i++) {
+			int v = L_int[i];  /* NA_INTEGER is < 1 */
+			bad |= (v < 1) | (v > prod);
+		}
+	} else {
+		double upper = (double) prod + 1.0;
+		#pragma omp simd reduction(|:bad)
+		for (i = i1; i < i2; i++) {
+			/* comparisons with NaN are false */
+			double v = L_dbl[i];
+			bad |= !(v >= 1.0 && v < upper);
+		}
+	}
+	if (bad)
+		return -1;
+
+	/* Process the L-index by blocks of L2M_BLOCK_SIZE values. For each
+	   block, 'x' holds the 0-based L-index values and we fill the
+	   M-index one column at a time. */
+	for (i0 = i1; i0 < i2; i0 += L2M_BLOCK_SIZE) {
+		n = i2 - i0 < L2M_BLOCK_SIZE ? (int) (i2 - i0) : L2M_BLOCK_SIZE;
+		if (L_int != NULL) {
+			const int *L_p = L_int + i0;
+			#pragma omp simd
+			for (k = 0; k < n; k++)
+				x[k] = (double) L_p[k] - 1.0;
+		} else {
+			const double *L_p = L_dbl + i0;
+			for (k = 0; k < n; k++)
+				x[k] = trunc(L_p[k]) - 1.0;
+		}
+		for (along = 0; along < ndim - 1; along++) {
+			int *M_p = M_cols[along] + i0;
+			double d = (double) dim[along], inv_d = 1.0 / d;
+			#pragma omp simd
+			for (k = 0; k < n; k++) {
+				double q = x[k] * inv_d + ROUNDING_MAGIC;
+				q -= ROUNDING_MAGIC;
+				double r = x[k] - q * d;
+				/* 'r' is in [-d, 2 * d) so 'c' below is
+				   floor(r / d) i.e. -1, 0, or 1. We don't
+				   use comparisons because they prevent
+				   vectorization unless -fno-trapping-math
+				   is used. */
+				double c = (r + 0.5) * inv_d - 0.5 +
+					   ROUNDING_MAGIC;
+				c -= ROUNDING_MAGIC;
+				q += c;
+				r -= c * d;
+				M_p[k] = (int) r + 1;
+				x[k] = q;
+			}
 		}
+		/* Since x < prod(dim), the quotient left is
+		   < dim[ndim - 1]. */
+		int *M_p = M_cols[ndim - 1] + i0;
+		#pragma omp simd
+		for (k = 0; k < n; k++)
+			M_p[k] = (int) x[k] + 1;
 	}
 	return 0;
 }
 
+/* One of 'L_int' or 'L_dbl' must be NULL. */
+static int M2L_fast(const int *dim, int ndim,
+		    const int *M, int M_nrow, int *L_int, double *L_dbl,
+		    int i1, int i2)
+{
+	int i, along, bad;
+	long long int stride;
+
+	/* (unsigned) m - 1u is >= (unsigned) d if 'm' is NA_INTEGER or < 1
+	   or > d. */
+	bad = 0;
+	stride = 1;
+	if (L_int != NULL) {
+		/* Unsigned arithmetic so we get the same (wrapped) values
+		   as M2L() when 'as.integer=TRUE' is used with dimensions
+		   that are too big. */
+		unsigned int *L_p = (unsigned int *) L_int;
+		for (i = i1; i < i2; i++)
+			L_p[i] = 1u;
+		for (along = 0; along < ndim; along++) {
+			unsigned int d = (unsigned int) dim[along];
+			unsigned int s = (unsigned int) stride;
+			const int *M_p = M + (R_xlen_t) along * M_nrow;
+			#pragma omp simd reduction(|:bad)
+			for (i = i1; i < i2; i++) {
+				unsigned int m0 = (unsigned int) M_p[i] - 1u;
+				bad |= m0 >= d;
+				L_p[i] += m0 * s;
+			}
+			stride *= dim[along];
+		}
+	} else {
+		for (i = i1; i < i2; i++)
+			L_dbl[i] = 1.0;
+		for (along = 0; along < ndim; along++) {
+			unsigned int d = (unsigned int) dim[along];
+			double s = (double) stride;
+			const int *M_p = M + (R_xlen_t) along * M_nrow;
+			#pragma omp simd reduction(|:bad)
+			for (i = i1; i < i2; i++) {
+				unsigned int m0 = (unsigned int) M_p[i] - 1u;
+				bad |= m0 >= d;
+				L_dbl[i] += (double) m0 * s;
+			}
+			stride *= dim[along];
+		}
+	}
+	return bad ? -1 : 0;
+}
+
+/* Raise the error recorded by the chunk that failed on the lowest row. */
+static void raise_first_error(const int *rets, const ErrState *errstates,
+			      int nchunk)
+{
+	int k, first = -1;
+
+	for (k = 0; k < nchunk; k++) {
+		if (rets[k] >= 0)
+			continue;
+		if (first < 0 || errstates[k].row < errstates[first].row)
+			first = k;
+	}
+	if (first >= 0)
+		error("%s", errstates[first].msg);
+	return;
+}
+
+/* When 'as_list' is TRUE the M-index is returned as a list of integer
+   vectors (one per dimension) instead of an integer matrix. Unlike a
+   matrix, the list can hold a long M-index i.e. an M-index with more than
+   INT_MAX rows, so this is the only way to support a long 'Lindex'. */
+
 /* --- .Call ENTRY POINT --- */
-SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names)
+SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names, SEXP as_list,
+		     SEXP nthread)
 {
-	int ret, dim_nrow, dim_ncol;
+	int ret, dim_nrow, dim_ncol, as_list0, nchunk, k, along;
+	long long int prod;
 	R_xlen_t Lindex_len;
-	SEXP ans;
+	SEXP ans, ans_elt, Lindex_names;
 
 	/* Check 'dim'. */
 	ret = get_matrix_nrow_ncol(dim, &dim_nrow, &dim_ncol);
@@ -335,34 +597,82 @@ SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names)
 	if (!(IS_INTEGER(Lindex) || IS_NUMERIC(Lindex)))
 		error("'Lindex' must be an integer (or numeric) vector");
 	Lindex_len = XLENGTH(Lindex);
-	/* R does not support matrices with dimensions > INT_MAX yet (as
-	   of April 2020) which means that we cannot support a long linear
-	   index. */
-	if (Lindex_len > INT_MAX)
-		error("'Lindex' is too long");
+	as_list0 = LOGICAL(as_list)[0];
+	/* R does not support matrices with dimensions > INT_MAX so a long
+	   'Lindex' can only be turned into a list. */
+	if (!as_list0 && Lindex_len > INT_MAX)
+		error("'Lindex' is too long to be turned into an M-index "
+		      "matrix.\n  Use 'as.list=TRUE' to get the M-index as "
+		      "a list of integer vectors.");
 	if (dim_nrow != 1 && dim_nrow != Lindex_len)
 		error("'dim' must have a single row or "
 		      "one row per element in 'Lindex'");
 
-	ans = PROTECT(allocMatrix(INTSXP, (int) Lindex_len, dim_ncol));
+	/* Alloc 'ans' and collect the pointers to its columns. */
+	int **M_cols = (int **) R_alloc(dim_ncol, sizeof(int *));
+	if (as_list0) {
+		ans = PROTECT(NEW_LIST(dim_ncol));
+		for (along = 0; along < dim_ncol; along++) {
+			ans_elt = allocVector(INTSXP, Lindex_len);
+			SET_VECTOR_ELT(ans, along, ans_elt);
+			M_cols[along] = INTEGER(ans_elt);
+		}
+	} else {
+		ans = PROTECT(allocMatrix(INTSXP, (int) Lindex_len, dim_ncol));
+		for (along = 0; along < dim_ncol; along++)
+			M_cols[along] = INTEGER(ans) +
+					(R_xlen_t) along * Lindex_len;
+	}
 
-	ret = L2M(INTEGER(dim), dim_ncol, dim_nrow, Lindex, INTEGER(ans));
-	if (ret < 0) {
-		UNPROTECT(1);
-		error("%s", errmsg_buf());
+	const int *dim_p = INTEGER(dim);
+	const int *L_int = IS_INTEGER(Lindex) ? INTEGER(Lindex) : NULL;
+	const double *L_dbl = IS_INTEGER(Lindex) ? NULL : REAL(Lindex);
+	prod = -1;
+	if (dim_nrow == 1 && dim_ncol != 0)
+		prod = get_fast_dim_prod(dim_p, dim_ncol);
+	nchunk = compute_nchunk(get_nthread(nthread), Lindex_len,
+				Lindex_len * dim_ncol);
+	int *rets = (int *) R_alloc(nchunk, sizeof(int));
+	ErrState *errstates = (ErrState *) R_alloc(nchunk, sizeof(ErrState));
+	#pragma omp parallel for num_threads(nchunk) schedule(static)
+	for (k = 0; k < nchunk; k++) {
+		R_xlen_t i1 = CHUNK_START(k, Lindex_len, nchunk);
+		R_xlen_t i2 = CHUNK_START(k + 1, Lindex_len, nchunk);
+		int ret_k = -1;
+		if (prod >= 0)
+			ret_k = L2M_fast(dim_p, dim_ncol, prod,
+					 L_int, L_dbl, i1, i2, M_cols);
+		if (ret_k < 0)
+			ret_k = L2M(dim_p, dim_ncol, dim_nrow,
+				    L_int, L_dbl, i1, i2, M_cols,
+				    errstates + k);
+		rets[k] = ret_k;
 	}
+	raise_first_error(rets, errstates, nchunk);
 
-	if (LOGICAL(use_names)[0])
-		set_rownames(ans, GET_NAMES(Lindex));
+	if (LOGICAL(use_names)[0]) {
+		Lindex_names = GET_NAMES(Lindex);
+		if (!as_list0) {
+			set_rownames(ans, Lindex_names);
+		} else if (Lindex_names != R_NilValue) {
+			/* The list elements share the same names. */
+			Lindex_names = PROTECT(duplicate(Lindex_names));
+			for (along = 0; along < dim_ncol; along++)
+				SET_NAMES(VECTOR_ELT(ans, along),
+					  Lindex_names);
+			UNPROTECT(1);
+		}
+	}
 
 	UNPROTECT(1);
 	return ans;
 }
 
 /* --- .Call ENTRY POINT --- */
-SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer)
+SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer,
+		     SEXP nthread)
 {
-	int ret, dim_nrow, dim_ncol, Mindex_nrow, Mindex_ncol;
+	int ret, dim_nrow, dim_ncol, Mindex_nrow, Mindex_ncol, nchunk, k;
 	long long int dim_prod;
 	SEXPTYPE ans_Rtype;
 	SEXP ans;
@@ -409,12 +719,31 @@ SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer)
 	}
 	ans = PROTECT(allocVector(ans_Rtype, Mindex_nrow));
 
-	ret = M2L(INTEGER(dim), dim_ncol, dim_nrow,
-		  INTEGER(Mindex), Mindex_nrow, ans);
-	if (ret < 0) {
-		UNPROTECT(1);
-		error("%s", errmsg_buf());
+	const int *dim_p = INTEGER(dim);
+	const int *M = INTEGER(Mindex);
+	int *L_int = ans_Rtype == INTSXP ? INTEGER(ans) : NULL;
+	double *L_dbl = ans_Rtype == INTSXP ? NULL : REAL(ans);
+	int use_fast = dim_nrow == 1 && dim_ncol != 0 &&
+		       get_fast_dim_prod(dim_p, dim_ncol) >= 0;
+	nchunk = compute_nchunk(get_nthread(nthread), Mindex_nrow,
+				(R_xlen_t) Mindex_nrow * dim_ncol);
+	int *rets = (int *) R_alloc(nchunk, sizeof(int));
+	ErrState *errstates = (ErrState *) R_alloc(nchunk, sizeof(ErrState));
+	#pragma omp parallel for num_threads(nchunk) schedule(static)
+	for (k = 0; k < nchunk; k++) {
+		int i1 = CHUNK_START(k, Mindex_nrow, nchunk);
+		int i2 = CHUNK_START(k + 1, Mindex_nrow, nchunk);
+		int ret_k = -1;
+		if (use_fast)
+			ret_k = M2L_fast(dim_p, dim_ncol, M, Mindex_nrow,
+					 L_int, L_dbl, i1, i2);
+		if (ret_k < 0)
+			ret_k = M2L(dim_p, dim_ncol, dim_nrow,
+				    M, Mindex_nrow, L_int, L_dbl, i1, i2,
+				    errstates + k);
+		rets[k] = ret_k;
 	}
+	raise_first_error(rets, errstates, nchunk);
 
 	if (LOGICAL(use_names)[0])
 		set_names(ans, GET_ROWNAMES(Mindex));
@@ -423,3 +752,532 @@ SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer)
 	return ans;
 }
 
+
+/****************************************************************************
+ * Run-length L-index
+ *
+ * A run-length L-index (also called "RL-index") is a compact form of an
+ * L-index made of runs of consecutive L-index values. At the C level it's
+ * represented by 2 parallel vectors 'start' and 'width' (integer or
+ * numeric) where the i-th run stands for L-index values start[i],
+ * start[i] + 1, ..., start[i] + width[i] - 1. Runs of width 0 are allowed
+ * (they contribute nothing). At the R level, an RL-index is represented by
+ * an IntegerRanges derivative (e.g. an IRanges object).
+ */
+
+static inline long long int get_trusted_elt(const int *x_int,
+					    const double *x_dbl, R_xlen_t i)
+{
+	return x_int != NULL ? (long long int) x_int[i]
+			     : (long long int) x_dbl[i];
+}
+
+/* Check the RL-index and return its expanded length i.e. sum(width).
+   All the L-index values in the RL-index must be <= 'maxval' (use
+   LLONG_MAX for no upper bound). The biggest L-index value in the RL-index
+   is stored in '*max_end'. */
+static R_xlen_t check_RLindex(SEXP start, SEXP width, long long int maxval,
+			      long long int *max_end)
+{
+	R_xlen_t nrun, i, ans;
+	long long int s, w;
+	ErrState errstate;
+
+	if (!(IS_INTEGER(start) || IS_NUMERIC(start)) ||
+	    !(IS_INTEGER(width) || IS_NUMERIC(width)))
+		error("'start' and 'width' must be integer (or numeric) "
+		      "vectors");
+	nrun = XLENGTH(start);
+	if (XLENGTH(width) != nrun)
+		error("'start' and 'width' must have the same length");
+	const int *start_int = IS_INTEGER(start) ? INTEGER(start) : NULL;
+	const double *start_dbl = IS_INTEGER(start) ? NULL : REAL(start);
+	const int *width_int = IS_INTEGER(width) ? INTEGER(width) : NULL;
+	const double *width_dbl = IS_INTEGER(width) ? NULL : REAL(width);
+	ans = 0;
+	*max_end = 0;
+	for (i = 0; i < nrun; i++) {
+		if (get_untrusted_elt(start_int, start_dbl, i, &s,
+				      "start", &errstate) < 0 ||
+		    get_untrusted_elt(width_int, width_dbl, i, &w,
+				      "width", &errstate) < 0)
+			error("%s", errstate.msg);
+		if (w < 0)
+			error("width[%lld] is < 0", (long long int) i + 1);
+		if (w == 0)
+			continue;
+		if (s < 1)
+			error("start[%lld] is < 1", (long long int) i + 1);
+		if (w - 1 > maxval - s)
+			error("run %lld in the RL-index is out of bounds",
+			      (long long int) i + 1);
+		if (w > R_XLEN_T_MAX - ans)
+			error("the RL-index is too long");
+		ans += w;
+		if (s + w - 1 > *max_end)
+			*max_end = s + w - 1;
+	}
+	return ans;
+}
+
+/* Used to build an RL-index in 2 passes: a first pass to count the runs
+   (with 'ans_start' and 'ans_width' set to NULL) and a second pass to
+   fill the result. Adjacent runs get merged. */
+typedef struct run_buf_t {
+	R_xlen_t nrun;
+	long long int start, width;  /* current run */
+	int *ans_start, *ans_width;
+} RunBuf;
+
+static void flush_run(RunBuf *buf)
+{
+	if (buf->width == 0)
+		return;
+	/* The RL-index is going to be turned into an IRanges object. */
+	if (buf->start + buf->width - 1 > INT_MAX)
+		error("the selection contains L-index values > INT_MAX "
+		      "so cannot\n  be represented as an RL-index");
+	if (buf->ans_start != NULL) {
+		buf->ans_start[buf->nrun] = (int) buf->start;
+		buf->ans_width[buf->nrun] = (int) buf->width;
+	}
+	buf->nrun++;
+	buf->width = 0;
+	return;
+}
+
+static inline void append_run(RunBuf *buf,
+			      long long int start, long long int width)
+{
+	if (width == 0)
+		return;
+	if (buf->width != 0 && buf->start + buf->width == start) {
+		buf->width += width;
+		return;
+	}
+	flush_run(buf);
+	buf->start = start;
+	buf->width = width;
+	return;
+}
+
+/* Return a RunBuf struct ready for the 2nd pass. 'buf' must be the RunBuf
+   struct used for the 1st pass. The RL-index is returned as a list of 2
+   integer vectors ("start" and "width") and is stored in '*ans'.
+   WARNING: '*ans' is left PROTECT'ed! */
+static RunBuf prepare_2nd_pass(RunBuf *buf, SEXP *ans)
+{
+	RunBuf buf2;
+	SEXP ans_start, ans_width, ans_names;
+
+	flush_run(buf);
+	*ans = PROTECT(NEW_LIST(2));
+	ans_start = NEW_INTEGER(buf->nrun);
+	SET_VECTOR_ELT(*ans, 0, ans_start);
+	ans_width = NEW_INTEGER(buf->nrun);
+	SET_VECTOR_ELT(*ans, 1, ans_width);
+	ans_names = PROTECT(NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("start"));
+	SET_STRING_ELT(ans_names, 1, mkChar("width"));
+	SET_NAMES(*ans, ans_names);
+	UNPROTECT(1);
+	buf2.nrun = buf2.width = 0;
+	buf2.ans_start = INTEGER(ans_start);
+	buf2.ans_width = INTEGER(ans_width);
+	return buf2;
+}
+
+/* Fill rows 'i0' to 'i0 + width - 1' of the M-index with the M-index
+   equivalent of L-index values 'start' to 'start + width - 1'. 'coords' is
+   a buffer of length 'ndim'. */
+static void RL2M(const int *dim, int ndim,
+		 long long int start, long long int width,
+		 R_xlen_t i0, int *const *M_cols, int *coords)
+{
+	long long int x, seg, k;
+	int along, c;
+
+	x = start - 1;
+	for (along = 0; along < ndim; along++) {
+		coords[along] = x % dim[along];
+		x /= dim[along];
+	}
+	while (width > 0) {
+		/* Walk along the 1st dimension. */
+		c = coords[0];
+		seg = dim[0] - c;
+		if (seg > width)
+			seg = width;
+		int *M_p = M_cols[0] + i0;
+		for (k = 0; k < seg; k++)
+			M_p[k] = c + k + 1;
+		for (along = 1; along < ndim; along++) {
+			M_p = M_cols[along] + i0;
+			c = coords[along] + 1;
+			for (k = 0; k < seg; k++)
+				M_p[k] = c;
+		}
+		i0 += seg;
+		width -= seg;
+		/* Move to the start of the next "column". */
+		coords[0] = 0;
+		for (along = 1; along < ndim; along++) {
+			if (++coords[along] < dim[along])
+				break;
+			coords[along] = 0;
+		}
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_Lindex2RLindex(SEXP Lindex)
+{
+	R_xlen_t Lindex_len, i;
+	long long int x;
+	RunBuf buf;
+	ErrState errstate;
+	int pass;
+	SEXP ans;
+
+	if (!(IS_INTEGER(Lindex) || IS_NUMERIC(Lindex)))
+		error("'Lindex' must be an integer (or numeric) vector");
+	Lindex_len = XLENGTH(Lindex);
+	const int *L_int = IS_INTEGER(Lindex) ? INTEGER(Lindex) : NULL;
+	const double *L_dbl = IS_INTEGER(Lindex) ? NULL : REAL(Lindex);
+	buf.nrun = buf.width = 0;
+	buf.ans_start = buf.ans_width = NULL;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1)
+			buf = prepare_2nd_pass(&buf, &ans);
+		for (i = 0; i < Lindex_len; i++) {
+			if (get_untrusted_elt(L_int, L_dbl, i, &x, "Lindex",
+					      &errstate) < 0)
+				error("%s", errstate.msg);
+			if (x < 1)
+				error("Lindex[%lld] is < 1",
+				      (long long int) i + 1);
+			append_run(&buf, x, 1);
+		}
+	}
+	flush_run(&buf);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex2Lindex(SEXP start, SEXP width)
+{
+	R_xlen_t ans_len, nrun, i, k, ans_off;
+	long long int max_end, s, w;
+	SEXP ans;
+
+	ans_len = check_RLindex(start, width, LLONG_MAX, &max_end);
+	nrun = XLENGTH(start);
+	const int *start_int = IS_INTEGER(start) ? INTEGER(start) : NULL;
+	const double *start_dbl = IS_INTEGER(start) ? NULL : REAL(start);
+	const int *width_int = IS_INTEGER(width) ? INTEGER(width) : NULL;
+	const double *width_dbl = IS_INTEGER(width) ? NULL : REAL(width);
+	if (max_end <= INT_MAX) {
+		ans = PROTECT(NEW_INTEGER(ans_len));
+		int *ans_p = INTEGER(ans);
+		for (i = ans_off = 0; i < nrun; i++) {
+			s = get_trusted_elt(start_int, start_dbl, i);
+			w = get_trusted_elt(width_int, width_dbl, i);
+			for (k = 0; k < w; k++)
+				ans_p[ans_off + k] = (int) (s + k);
+			ans_off += w;
+		}
+	} else {
+		ans = PROTECT(NEW_NUMERIC(ans_len));
+		double *ans_p = REAL(ans);
+		for (i = ans_off = 0; i < nrun; i++) {
+			s = get_trusted_elt(start_int, start_dbl, i);
+			w = get_trusted_elt(width_int, width_dbl, i);
+			for (k = 0; k < w; k++)
+				ans_p[ans_off + k] = (double) (s + k);
+			ans_off += w;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex2Mindex(SEXP start, SEXP width, SEXP dim, SEXP as_list)
+{
+	int ndim, as_list0, along;
+	R_xlen_t ans_nrow, nrun, i, i0;
+	long long int max_end, w;
+	SEXP ans, ans_elt;
+
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	ndim = LENGTH(dim);
+	const int *dim_p = INTEGER(dim);
+	ans_nrow = check_RLindex(start, width, safe_dim_prod(dim_p, ndim),
+				 &max_end);
+	as_list0 = LOGICAL(as_list)[0];
+	if (!as_list0 && ans_nrow > INT_MAX)
+		error("the RL-index is too long to be turned into an M-index "
+		      "matrix.\n  Use 'as.list=TRUE' to get the M-index as "
+		      "a list of integer vectors.");
+
+	/* Alloc 'ans' and collect the pointers to its columns. */
+	int **M_cols = (int **) R_alloc(ndim, sizeof(int *));
+	if (as_list0) {
+		ans = PROTECT(NEW_LIST(ndim));
+		for (along = 0; along < ndim; along++) {
+			ans_elt = allocVector(INTSXP, ans_nrow);
+			SET_VECTOR_ELT(ans, along, ans_elt);
+			M_cols[along] = INTEGER(ans_elt);
+		}
+	} else {
+		ans = PROTECT(allocMatrix(INTSXP, (int) ans_nrow, ndim));
+		for (along = 0; along < ndim; along++)
+			M_cols[along] = INTEGER(ans) +
+					(R_xlen_t) along * ans_nrow;
+	}
+	if (ndim == 0) {
+		UNPROTECT(1);
+		return ans;
+	}
+
+	nrun = XLENGTH(start);
+	const int *start_int = IS_INTEGER(start) ? INTEGER(start) : NULL;
+	const double *start_dbl = IS_INTEGER(start) ? NULL : REAL(start);
+	const int *width_int = IS_INTEGER(width) ? INTEGER(width) : NULL;
+	const double *width_dbl = IS_INTEGER(width) ? NULL : REAL(width);
+	int *coords = (int *) R_alloc(ndim, sizeof(int));
+	for (i = i0 = 0; i < nrun; i++) {
+		w = get_trusted_elt(width_int, width_dbl, i);
+		if (w == 0)
+			continue;
+		RL2M(dim_p, ndim, get_trusted_elt(start_int, start_dbl, i), w,
+		     i0, M_cols, coords);
+		i0 += w;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* 'Nindex' must be a normalized N-index i.e. a list where each list
+   element is NULL or an integer vector of valid positions along the
+   corresponding dimension. The runs are emitted in the order of the
+   elements of 'subset_by_Nindex(a, Nindex)'. */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_Nindex2RLindex(SEXP Nindex, SEXP dim)
+{
+	int ndim, along, d, n1, nrun1, k, pass;
+	R_xlen_t n, i;
+	long long int offset;
+	const int *s;
+	RunBuf buf;
+	SEXP subscript, ans;
+
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	ndim = LENGTH(dim);
+	const int *dim_p = INTEGER(dim);
+	safe_dim_prod(dim_p, ndim);  /* checks 'dim' */
+	if (!isVectorList(Nindex) || LENGTH(Nindex) != ndim)
+		error("'Nindex' must be a list with one list element "
+		      "per dimension in the array");
+	long long int *strides =
+		(long long int *) R_alloc(ndim, sizeof(long long int));
+	int *lens = (int *) R_alloc(ndim, sizeof(int));
+	int *idx = (int *) R_alloc(ndim, sizeof(int));
+	for (along = 0; along < ndim; along++) {
+		d = dim_p[along];
+		strides[along] = along == 0 ? 1 : strides[along - 1] *
+						  dim_p[along - 1];
+		subscript = VECTOR_ELT(Nindex, along);
+		if (subscript == R_NilValue) {
+			lens[along] = d;
+			continue;
+		}
+		if (!IS_INTEGER(subscript))
+			error("'Nindex' must contain integer vectors or NULLs");
+		n = XLENGTH(subscript);
+		s = INTEGER(subscript);
+		for (i = 0; i < n; i++) {
+			if (INVALID_COORD(s[i], d))
+				error("Nindex[[%d]][%lld] is NA or < 1 "
+				      "or > dim[%d]", along + 1,
+				      (long long int) i + 1, along + 1);
+		}
+		lens[along] = (int) n;
+	}
+
+	buf.nrun = buf.width = 0;
+	buf.ans_start = buf.ans_width = NULL;
+	for (along = 0; along < ndim; along++)
+		if (lens[along] == 0)
+			break;
+	if (ndim == 0 || along < ndim) {
+		prepare_2nd_pass(&buf, &ans);
+		UNPROTECT(1);
+		return ans;
+	}
+
+	/* Compress the 1st subscript into runs. */
+	subscript = VECTOR_ELT(Nindex, 0);
+	n1 = lens[0];
+	int *start1 = (int *) R_alloc(n1, sizeof(int));
+	int *width1 = (int *) R_alloc(n1, sizeof(int));
+	if (subscript == R_NilValue) {
+		nrun1 = 1;
+		start1[0] = 1;
+		width1[0] = n1;
+	} else {
+		s = INTEGER(subscript);
+		nrun1 = 0;
+		for (k = 0; k < n1; k++) {
+			if (nrun1 != 0 &&
+			    start1[nrun1 - 1] + width1[nrun1 - 1] == s[k]) {
+				width1[nrun1 - 1]++;
+				continue;
+			}
+			start1[nrun1] = s[k];
+			width1[nrun1] = 1;
+			nrun1++;
+		}
+	}
+
+	/* Walk on the outer dimensions. */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1)
+			buf = prepare_2nd_pass(&buf, &ans);
+		for (along = 1; along < ndim; along++)
+			idx[along] = 0;
+		while (1) {
+			offset = 0;
+			for (along = 1; along < ndim; along++) {
+				subscript = VECTOR_ELT(Nindex, along);
+				d = subscript == R_NilValue ?
+					idx[along] :
+					INTEGER(subscript)[idx[along]] - 1;
+				offset += strides[along] * d;
+			}
+			for (k = 0; k < nrun1; k++)
+				append_run(&buf, offset + start1[k], width1[k]);
+			for (along = 1; along < ndim; along++) {
+				if (++idx[along] < lens[along])
+					break;
+				idx[along] = 0;
+			}
+			if (along == ndim)
+				break;
+		}
+	}
+	flush_run(&buf);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Only for an ordinary vector (atomic or list). The runs of elements are
+   copied with copy_vector_block() i.e. without expanding the RL-index. */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_subset_by_RLindex(SEXP x, SEXP start, SEXP width)
+{
+	R_xlen_t ans_len, nrun, i, ans_off;
+	long long int max_end, s, w;
+	SEXP ans, x_names, ans_names;
+
+	ans_len = check_RLindex(start, width, XLENGTH(x), &max_end);
+	nrun = XLENGTH(start);
+	const int *start_int = IS_INTEGER(start) ? INTEGER(start) : NULL;
+	const double *start_dbl = IS_INTEGER(start) ? NULL : REAL(start);
+	const int *width_int = IS_INTEGER(width) ? INTEGER(width) : NULL;
+	const double *width_dbl = IS_INTEGER(width) ? NULL : REAL(width);
+	x_names = GET_NAMES(x);
+	ans = PROTECT(allocVector(TYPEOF(x), ans_len));
+	ans_names = R_NilValue;
+	if (x_names != R_NilValue) {
+		ans_names = NEW_CHARACTER(ans_len);
+		SET_NAMES(ans, ans_names);
+	}
+	for (i = ans_off = 0; i < nrun; i++) {
+		w = get_trusted_elt(width_int, width_dbl, i);
+		if (w == 0)
+			continue;
+		s = get_trusted_elt(start_int, start_dbl, i) - 1;
+		copy_vector_block(ans, ans_off, x, s, w);
+		if (x_names != R_NilValue)
+			copy_vector_block(ans_names, ans_off, x_names, s, w);
+		ans_off += w;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Write 'nelt' copies of 'x[offset]' to 'x' starting at 'offset'. Only one
+   element is copied element-wise, then the block of elements already
+   written gets doubled at each iteration, so this takes O(log(nelt)) calls
+   to copy_vector_block(). */
+static void fill_vector_block(SEXP x, R_xlen_t offset, R_xlen_t nelt)
+{
+	R_xlen_t k, n;
+
+	for (k = 1; k < nelt; k += n) {
+		n = nelt - k < k ? nelt - k : k;
+		copy_vector_block(x, offset + k, x, offset, n);
+	}
+	return;
+}
+
+/* Only for an ordinary vector (atomic or list) 'x' and a 'value' of the same
+   type. 'value' is recycled. Like with '[<-', 'x' gets duplicated first.
+   The runs of elements are written with copy_vector_block() i.e. without
+   expanding the RL-index. */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_subassign_by_RLindex(SEXP x, SEXP start, SEXP width, SEXP value)
+{
+	R_xlen_t total_len, nrun, value_len, value_off, i, n;
+	long long int max_end, s, w;
+	SEXP ans;
+
+	if (TYPEOF(value) != TYPEOF(x))
+		error("S4Arrays internal error in "
+		      "C_subassign_by_RLindex():\n"
+		      "    'x' and 'value' must have the same type");
+	total_len = check_RLindex(start, width, XLENGTH(x), &max_end);
+	if (total_len == 0)
+		return x;
+	value_len = XLENGTH(value);
+	if (value_len == 0)
+		error("replacement has length zero");
+	nrun = XLENGTH(start);
+	const int *start_int = IS_INTEGER(start) ? INTEGER(start) : NULL;
+	const double *start_dbl = IS_INTEGER(start) ? NULL : REAL(start);
+	const int *width_int = IS_INTEGER(width) ? INTEGER(width) : NULL;
+	const double *width_dbl = IS_INTEGER(width) ? NULL : REAL(width);
+	ans = PROTECT(duplicate(x));
+	for (i = value_off = 0; i < nrun; i++) {
+		w = get_trusted_elt(width_int, width_dbl, i);
+		if (w == 0)
+			continue;
+		s = get_trusted_elt(start_int, start_dbl, i) - 1;
+		if (value_len == 1) {
+			copy_vector_block(ans, s, value, 0, 1);
+			fill_vector_block(ans, s, w);
+			continue;
+		}
+		while (w > 0) {
+			n = value_len - value_off;
+			if (n > w)
+				n = w;
+			copy_vector_block(ans, s, value, value_off, n);
+			s += n;
+			w -= n;
+			value_off += n;
+			if (value_off == value_len)
+				value_off = 0;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
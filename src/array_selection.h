@@ -6,8 +6,22 @@
 #define	INVALID_COORD(coord, maxcoord) \
 	((coord) == NA_INTEGER || (coord) < 1 || (coord) > (maxcoord))
 
-SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names);
-SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer);
+SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names, SEXP as_list,
+		     SEXP nthread);
+SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer,
+		     SEXP nthread);
+
+SEXP C_Lindex2RLindex(SEXP Lindex);
+
+SEXP C_RLindex2Lindex(SEXP start, SEXP width);
+
+SEXP C_RLindex2Mindex(SEXP start, SEXP width, SEXP dim, SEXP as_list);
+
+SEXP C_Nindex2RLindex(SEXP Nindex, SEXP dim);
+
+SEXP C_subset_by_RLindex(SEXP x, SEXP start, SEXP width);
+
+SEXP C_subassign_by_RLindex(SEXP x, SEXP start, SEXP width, SEXP value);
 
 #endif  /* _ARRAY_SELECTION_H_ */
 
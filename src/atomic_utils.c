@@ -0,0 +1,104 @@
+/****************************************************************************
+ *              Low-level helpers to copy atomic vector data                *
+ ****************************************************************************/
+#include "atomic_utils.h"
+
+#include <string.h>  /* for memcpy() */
+
+
+/****************************************************************************
+ * Element size and data pointer of an atomic vector
+ *
+ * Only the atomic types that have a fixed-size element (i.e. all of them
+ * except STRSXP) are supported. get_atomic_eltsize() returns 0 and
+ * get_atomic_dataptr() returns NULL for the other types.
+ */
+
+size_t get_atomic_eltsize(SEXPTYPE Rtype)
+{
+	switch (Rtype) {
+	    case LGLSXP: case INTSXP: return sizeof(int);
+	    case REALSXP: return sizeof(double);
+	    case CPLXSXP: return sizeof(Rcomplex);
+	    case RAWSXP: return sizeof(Rbyte);
+	}
+	return 0;
+}
+
+void *get_atomic_dataptr(SEXP x)
+{
+	switch (TYPEOF(x)) {
+	    case LGLSXP: return LOGICAL(x);
+	    case INTSXP: return INTEGER(x);
+	    case REALSXP: return REAL(x);
+	    case CPLXSXP: return COMPLEX(x);
+	    case RAWSXP: return RAW(x);
+	}
+	return NULL;
+}
+
+
+/****************************************************************************
+ * Copy a block of elements from one vector to another vector of a different
+ * type, doing the type conversion on the fly. This avoids coercing the full
+ * input vector first.
+ *
+ * Only the conversions within the raw < logical < integer < double part of
+ * the type hierarchy are supported. They are the ones where the result of
+ * converting element by element is guaranteed to be the same as calling
+ * coerceVector() on the full vector.
+ */
+
+int can_coerce_while_copying(SEXPTYPE out_type, SEXPTYPE in_type)
+{
+	switch (out_type) {
+	    case LGLSXP:
+		return in_type == RAWSXP;
+	    case INTSXP:
+		return in_type == RAWSXP || in_type == LGLSXP;
+	    case REALSXP:
+		return in_type == RAWSXP || in_type == LGLSXP ||
+		       in_type == INTSXP;
+	}
+	return 0;
+}
+
+/* Logical and integer vectors use the same internal representation so
+   we treat them the same. 'out' and 'in' must point to the first element
+   of the block in the output and input vectors, respectively. */
+void coerce_block(void *out, SEXPTYPE out_type,
+		const void *in, SEXPTYPE in_type, R_xlen_t nelt)
+{
+	R_xlen_t k;
+
+	if (in_type == RAWSXP) {
+		const Rbyte *in_p = (const Rbyte *) in;
+		if (out_type == REALSXP) {
+			double *out_p = (double *) out;
+			for (k = 0; k < nelt; k++)
+				out_p[k] = (double) in_p[k];
+		} else if (out_type == INTSXP) {
+			int *out_p = (int *) out;
+			for (k = 0; k < nelt; k++)
+				out_p[k] = (int) in_p[k];
+		} else {
+			int *out_p = (int *) out;
+			for (k = 0; k < nelt; k++)
+				out_p[k] = in_p[k] != 0;
+		}
+		return;
+	}
+	const int *in_p = (const int *) in;
+	if (out_type == REALSXP) {
+		double *out_p = (double *) out;
+		for (k = 0; k < nelt; k++) {
+			int v = in_p[k];
+			out_p[k] = v == NA_INTEGER ? NA_REAL : (double) v;
+		}
+	} else {
+		/* logical to integer */
+		memcpy(out, in_p, sizeof(int) * nelt);
+	}
+	return;
+}
+
@@ -0,0 +1,16 @@
+#ifndef _ATOMIC_UTILS_H_
+#define _ATOMIC_UTILS_H_
+
+#include <Rdefines.h>
+
+size_t get_atomic_eltsize(SEXPTYPE Rtype);
+
+void *get_atomic_dataptr(SEXP x);
+
+int can_coerce_while_copying(SEXPTYPE out_type, SEXPTYPE in_type);
+
+void coerce_block(void *out, SEXPTYPE out_type,
+		const void *in, SEXPTYPE in_type, R_xlen_t nelt);
+
+#endif  /* _ATOMIC_UTILS_H_ */
+
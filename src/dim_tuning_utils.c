@@ -3,6 +3,8 @@
  ****************************************************************************/
 #include "dim_tuning_utils.h"
 
+#include <string.h>  /* for memcpy() */
+
 
 /****************************************************************************
  * Dim tuning and the 'dim_tuner' argument
@@ -49,12 +51,14 @@
 #define	DROP_DIM       -1
 #define	ADD_DIM         1
 
-/* Return the "new" number of dimensions i.e. the number of dims that we
-   will get after tuning the current vector of dimensions. Note that this
-   is simply the number of non-negative values in 'ops' (i.e. number of
-   0 and 1 values together). */
-static int validate_dim_tuner(const int *ops, int nops,
-		const int *dims, int ndim)
+/* Check the parts of 'dim_tuner' that don't depend on the dimensions of the
+   object to tune. Return the "new" number of dimensions i.e. the number of
+   dims that we will get after tuning the current vector of dimensions. Note
+   that this is simply the number of non-negative values in 'ops' (i.e.
+   number of 0 and 1 values together). The number of dimensions that the
+   object to tune must have (i.e. the number of non-positive values in 'ops')
+   is stored in '*ndim'. */
+static int check_dim_tuner_ops(const int *ops, int nops, int *ndim)
 {
 	int along1, along2, nkept, r, op;
 
@@ -65,41 +69,140 @@ static int validate_dim_tuner(const int *ops, int nops,
 			along2++;
 			continue;
 		}
-		if (along1 >= ndim)
-			error("S4Arrays internal error in "
-			      "validate_dim_tuner():\n"
-			      "    number of 0 (KEEP) or -1 (DROP) values "
-			      "in 'dim_tuner' is > 'length(dim(x))'");
 		if (op == KEEP_DIM) {
 			along2++;
 			nkept++;
-			along1++;
-			continue;
-		}
-		if (op != DROP_DIM)
+		} else if (op != DROP_DIM) {
 			error("S4Arrays internal error in "
-			      "validate_dim_tuner():\n"
+			      "check_dim_tuner_ops():\n"
 			      "    'dim_tuner' can only contain 0 (KEEP), "
 			      "-1 (DROP), or 1 (ADD) values");
-		if (dims[along1] != 1)
+		}
+		along1++;
+	}
+	if (nkept == 0)
+		error("S4Arrays internal error in "
+		      "check_dim_tuner_ops():\n"
+		      "    'dim_tuner' must contain at least one 0");
+	*ndim = along1;
+	return along2;
+}
+
+static void check_ndim(int ndim, int expected_ndim)
+{
+	if (ndim > expected_ndim)
+		error("S4Arrays internal error in check_ndim():\n"
+		      "    number of 0 (KEEP) or -1 (DROP) values "
+		      "in 'dim_tuner' is < 'length(dim(x))'");
+	if (ndim < expected_ndim)
+		error("S4Arrays internal error in check_ndim():\n"
+		      "    number of 0 (KEEP) or -1 (DROP) values "
+		      "in 'dim_tuner' is > 'length(dim(x))'");
+	return;
+}
+
+/* Check that the dimensions to drop are ineffective. 'dims' is assumed to
+   have the length expected by 'ops'. */
+static void check_dropped_dims(const int *ops, int nops, const int *dims)
+{
+	int along1, r, op;
+
+	along1 = 0;
+	for (r = 0; r < nops; r++) {
+		op = ops[r];  /* ADD_DIM, KEEP_DIM, or DROP_DIM */
+		if (op == ADD_DIM)
+			continue;
+		if (op == DROP_DIM && dims[along1] != 1)
 			error("S4Arrays internal error in "
-			      "validate_dim_tuner():\n"
+			      "check_dropped_dims():\n"
 			      "    'dim_tuner[%d]' (= -1) is "
 			      "mapped to 'dim(x)[%d]' (= %d)\n"
 			      "    which cannot be dropped",
 			      r + 1, along1 + 1, dims[along1]);
 		along1++;
 	}
-	if (along1 < ndim)
-		error("S4Arrays internal error in "
-		      "validate_dim_tuner():\n"
-		      "    number of 0 (KEEP) or -1 (DROP) values "
-		      "in 'dim_tuner' is < 'length(dim(x))'");
-	if (nkept == 0)
-		error("S4Arrays internal error in "
-		      "validate_dim_tuner():\n"
-		      "    'dim_tuner' must contain at least one 0");
-	return along2;
+	return;
+}
+
+/* Return the "new" number of dimensions. */
+static int validate_dim_tuner(const int *ops, int nops,
+		const int *dims, int ndim)
+{
+	int ans, expected_ndim;
+
+	ans = check_dim_tuner_ops(ops, nops, &expected_ndim);
+	check_ndim(ndim, expected_ndim);
+	check_dropped_dims(ops, nops, dims);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Prepared dim tuners
+ *
+ * A "prepared dim tuner" is a 'dim_tuner' vector that was validated once
+ * and for all with C_prepare_dim_tuner(), so it can be used on many vectors
+ * of dimensions without being revalidated every time. It's a list of 3
+ * elements: the original 'dim_tuner' vector, the number of dimensions of
+ * the objects it can be used on, and the "new" number of dimensions.
+ * All the entry points below accept a prepared dim tuner or a 'dim_tuner'
+ * vector.
+ * Note that the prepared dim tuner is a list and not an integer vector with
+ * attributes so that something like '-dim_tuner' cannot silently produce
+ * an invalid one.
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_prepare_dim_tuner(SEXP dim_tuner)
+{
+	int ndim, new_ndim;
+	SEXP ans, ans_names;
+
+	new_ndim = check_dim_tuner_ops(INTEGER(dim_tuner), LENGTH(dim_tuner),
+				       &ndim);
+	ans = PROTECT(NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, duplicate(dim_tuner));
+	SET_VECTOR_ELT(ans, 1, ScalarInteger(ndim));
+	SET_VECTOR_ELT(ans, 2, ScalarInteger(new_ndim));
+	ans_names = PROTECT(NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("dim_tuner"));
+	SET_STRING_ELT(ans_names, 1, mkChar("ndim"));
+	SET_STRING_ELT(ans_names, 2, mkChar("new_ndim"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* Extract the ops from 'dim_tuner' (a prepared dim tuner or an integer
+   vector). Return the "new" number of dimensions if 'dim_tuner' is a
+   prepared dim tuner, or -1 if it's an integer vector that still needs
+   to be validated. In the former case, also store in '*ndim' the number
+   of dimensions of the objects that the tuner can be used on. */
+static int get_dim_tuner_ops(SEXP dim_tuner,
+		const int **ops, int *nops, int *ndim)
+{
+	SEXP ops_sxp;
+
+	if (!IS_LIST(dim_tuner)) {
+		*ops = INTEGER(dim_tuner);
+		*nops = LENGTH(dim_tuner);
+		return -1;
+	}
+	ops_sxp = VECTOR_ELT(dim_tuner, 0);
+	*ops = INTEGER(ops_sxp);
+	*nops = LENGTH(ops_sxp);
+	*ndim = INTEGER(VECTOR_ELT(dim_tuner, 1))[0];
+	return INTEGER(VECTOR_ELT(dim_tuner, 2))[0];
+}
+
+static int is_noop_dim_tuner(const int *ops, int nops)
+{
+	int r;
+
+	for (r = 0; r < nops; r++)
+		if (ops[r] != KEEP_DIM)
+			return 0;
+	return 1;
 }
 
 
@@ -203,28 +306,150 @@ static int compute_tuned_dimnames_length(SEXP dimnames,
 /* --- .Call ENTRY POINT --- */
 SEXP C_tune_dims(SEXP dim, SEXP dim_tuner)
 {
-	int ndim, nops, ans_len;
+	int ndim, nops, expected_ndim, ans_len;
 	const int *dims, *ops;
 
 	ndim = LENGTH(dim);
 	dims = INTEGER(dim);
-	nops = LENGTH(dim_tuner);
-	ops = INTEGER(dim_tuner);
-	ans_len = validate_dim_tuner(ops, nops, dims, ndim);
+	ans_len = get_dim_tuner_ops(dim_tuner, &ops, &nops, &expected_ndim);
+	if (ans_len == -1) {
+		ans_len = validate_dim_tuner(ops, nops, dims, ndim);
+	} else {
+		check_ndim(ndim, expected_ndim);
+		check_dropped_dims(ops, nops, dims);
+	}
+	/* No-op tuning (i.e. 'dim_tuner' contains only 0's). No need to
+	   allocate a new vector in this case. */
+	if (ans_len == nops && ans_len == ndim)
+		return dim;
 	return tune_dims(dims, GET_NAMES(dim), ops, nops, ans_len);
 }
 
 /* --- .Call ENTRY POINT --- */
 SEXP C_tune_dimnames(SEXP dimnames, SEXP dim_tuner)
 {
-	int nops, ans_len;
+	int nops, ndim, ans_len;
 	const int *ops;
 
-	nops = LENGTH(dim_tuner);
-	ops = INTEGER(dim_tuner);
+	get_dim_tuner_ops(dim_tuner, &ops, &nops, &ndim);
 	ans_len = compute_tuned_dimnames_length(dimnames, ops, nops);
 	if (ans_len == 0)
 		return R_NilValue;
+	/* No-op tuning. Note that the names on 'dimnames' (if any) are not
+	   propagated by tune_dimnames() so we can only return 'dimnames'
+	   as-is if it has no names. */
+	if (LENGTH(dimnames) == nops && GET_NAMES(dimnames) == R_NilValue &&
+	    is_noop_dim_tuner(ops, nops))
+		return dimnames;
 	return tune_dimnames(dimnames, ops, nops, ans_len);
 }
 
+
+/****************************************************************************
+ * C_tune_dims_batch()
+ *
+ * Apply the same dim tuning to many vectors of dimensions at once.
+ * The vectors of dimensions are passed as the rows of integer matrix 'dims'
+ * (e.g. as returned by 'dims(grid)'). The 'dim_tuner' is validated only
+ * once, and the tuned vectors of dimensions are returned as the rows of
+ * an integer matrix. Because the matrices are stored column by column,
+ * each column of the result is either filled with 1's (added dimension)
+ * or copied with a single memcpy() (kept dimension).
+ */
+
+/* Check that the columns of 'dims' that correspond to the dimensions to
+   drop contain only 1's. */
+static void check_dropped_cols(const int *ops, int nops,
+		const int *dims, R_xlen_t nrow)
+{
+	int along1, r, op;
+	R_xlen_t i;
+	const int *col;
+
+	along1 = 0;
+	for (r = 0; r < nops; r++) {
+		op = ops[r];  /* ADD_DIM, KEEP_DIM, or DROP_DIM */
+		if (op == ADD_DIM)
+			continue;
+		if (op == DROP_DIM) {
+			col = dims + along1 * nrow;
+			for (i = 0; i < nrow; i++) {
+				if (col[i] != 1)
+					error("S4Arrays internal error in "
+					      "check_dropped_cols():\n"
+					      "    'dim_tuner[%d]' (= -1) is "
+					      "mapped to 'dims[%.0f, %d]' "
+					      "(= %d)\n"
+					      "    which cannot be dropped",
+					      r + 1, (double) i + 1,
+					      along1 + 1, col[i]);
+			}
+		}
+		along1++;
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_tune_dims_batch(SEXP dims, SEXP dim_tuner)
+{
+	SEXP dims_dim, ans, dims_dimnames, ans_colnames, ans_dimnames;
+	int ndim, nops, expected_ndim, ans_ncol, along1, along2, r, op;
+	R_xlen_t nrow, i;
+	const int *ops, *in;
+	int *out;
+
+	dims_dim = GET_DIM(dims);
+	if (dims_dim == R_NilValue || LENGTH(dims_dim) != 2)
+		error("S4Arrays internal error in C_tune_dims_batch():\n"
+		      "    'dims' must be a matrix");
+	nrow = INTEGER(dims_dim)[0];
+	ndim = INTEGER(dims_dim)[1];
+	ans_ncol = get_dim_tuner_ops(dim_tuner, &ops, &nops, &expected_ndim);
+	if (ans_ncol == -1)
+		ans_ncol = check_dim_tuner_ops(ops, nops, &expected_ndim);
+	check_ndim(ndim, expected_ndim);
+	check_dropped_cols(ops, nops, INTEGER(dims), nrow);
+	if (ans_ncol == nops && ans_ncol == ndim)
+		return dims;
+
+	dims_dimnames = GET_DIMNAMES(dims);
+	ans = PROTECT(allocMatrix(INTSXP, nrow, ans_ncol));
+	ans_colnames = R_NilValue;
+	if (dims_dimnames != R_NilValue &&
+	    VECTOR_ELT(dims_dimnames, 1) != R_NilValue)
+		ans_colnames = PROTECT(NEW_CHARACTER(ans_ncol));
+	in = INTEGER(dims);
+	out = INTEGER(ans);
+	along1 = along2 = 0;
+	for (r = 0; r < nops; r++) {
+		op = ops[r];  /* ADD_DIM, KEEP_DIM, or DROP_DIM */
+		if (op == ADD_DIM) {
+			for (i = 0; i < nrow; i++)
+				out[i] = 1;
+			out += nrow;
+			along2++;
+			continue;
+		}
+		if (op == KEEP_DIM) {
+			memcpy(out, in + along1 * nrow, sizeof(int) * nrow);
+			if (ans_colnames != R_NilValue)
+				SET_STRING_ELT(ans_colnames, along2,
+				    STRING_ELT(VECTOR_ELT(dims_dimnames, 1),
+					       along1));
+			out += nrow;
+			along2++;
+		}
+		along1++;
+	}
+	if (ans_colnames != R_NilValue) {
+		ans_dimnames = PROTECT(NEW_LIST(2));
+		SET_VECTOR_ELT(ans_dimnames, 0, VECTOR_ELT(dims_dimnames, 0));
+		SET_VECTOR_ELT(ans_dimnames, 1, ans_colnames);
+		SET_DIMNAMES(ans, ans_dimnames);
+		UNPROTECT(2);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
@@ -3,6 +3,10 @@
 
 #include <Rdefines.h>
 
+SEXP C_prepare_dim_tuner(
+	SEXP dim_tuner
+);
+
 SEXP C_tune_dims(
 	SEXP dim,
 	SEXP dim_selector
@@ -13,5 +17,10 @@ SEXP C_tune_dimnames(
 	SEXP dim_selector
 );
 
+SEXP C_tune_dims_batch(
+	SEXP dims,
+	SEXP dim_tuner
+);
+
 #endif  /* _DIM_TUNING_UTILS_H_ */
 
@@ -0,0 +1,217 @@
+/****************************************************************************
+ *                  Traversal orders of the elements of a grid              *
+ ****************************************************************************/
+#include "gridOrder.h"
+
+#include <limits.h>  /* for INT_MAX */
+#include <stdint.h>  /* for uint64_t */
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for strcmp(), memset() */
+
+
+/****************************************************************************
+ * Helpers
+ */
+
+/* Walk on the grid elements in column-major order and store their 0-based
+   coordinates in 'coords'. Return 0 when there are no more grid elements. */
+static inline int next_coords(const int *dim, int ndim, int *coords)
+{
+	int along;
+
+	for (along = 0; along < ndim; along++) {
+		if (++coords[along] < dim[along])
+			return 1;
+		coords[along] = 0;
+	}
+	return 0;
+}
+
+/* Nb of bits needed to represent the 0-based coordinates of the grid
+   elements along the longest dimension. */
+static int get_nbit(const int *dim, int ndim)
+{
+	int along, max_coord = 0, nbit = 0;
+
+	for (along = 0; along < ndim; along++)
+		if (dim[along] - 1 > max_coord)
+			max_coord = dim[along] - 1;
+	while (max_coord != 0) {
+		nbit++;
+		max_coord >>= 1;
+	}
+	return nbit == 0 ? 1 : nbit;
+}
+
+/* Interleave the 'nbit' lowest bits of the 'ndim' coordinates in 'X',
+   most significant bit first. At each bit level, the bit of 'X[0]' goes
+   first. */
+static inline uint64_t interleave_bits(const unsigned int *X, int ndim,
+				       int nbit)
+{
+	uint64_t key = 0;
+	int bit, along;
+
+	for (bit = nbit - 1; bit >= 0; bit--)
+		for (along = 0; along < ndim; along++)
+			key = (key << 1) | ((X[along] >> bit) & 1U);
+	return key;
+}
+
+/* Turn the coordinates in 'X' into the "transpose" of their Hilbert index,
+   in place. From John Skilling, "Programming the Hilbert curve", AIP
+   Conference Proceedings 707, 381 (2004). */
+static void axes_to_transpose(unsigned int *X, int ndim, int nbit)
+{
+	unsigned int M = 1U << (nbit - 1), P, Q, t;
+	int i;
+
+	/* Inverse undo. */
+	for (Q = M; Q > 1; Q >>= 1) {
+		P = Q - 1;
+		for (i = 0; i < ndim; i++) {
+			if (X[i] & Q) {
+				X[0] ^= P;
+			} else {
+				t = (X[0] ^ X[i]) & P;
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+		}
+	}
+	/* Gray encode. */
+	for (i = 1; i < ndim; i++)
+		X[i] ^= X[i - 1];
+	t = 0;
+	for (Q = M; Q > 1; Q >>= 1)
+		if (X[ndim - 1] & Q)
+			t ^= Q - 1;
+	for (i = 0; i < ndim; i++)
+		X[i] ^= t;
+	return;
+}
+
+typedef struct keyed_elt_t {
+	uint64_t key;
+	int id;
+} KeyedElt;
+
+static int compar_keys(const void *p1, const void *p2)
+{
+	uint64_t key1 = ((const KeyedElt *) p1)->key,
+		 key2 = ((const KeyedElt *) p2)->key;
+	return (key1 > key2) - (key1 < key2);
+}
+
+/* Sort the grid elements by Morton or Hilbert key. Keys are computed on
+   the smallest hypercube of side 2^nbit that contains the grid, and are
+   unique, so the result doesn't depend on the sorting algorithm. */
+static void order_by_key(const int *dim, int ndim, int grid_len,
+			 int hilbert, int *out)
+{
+	int nbit, *coords, i, along;
+	unsigned int *X;
+	KeyedElt *elts;
+
+	nbit = get_nbit(dim, ndim);
+	if (ndim * nbit > 64)
+		error("the grid is too big (too many dimensions and/or "
+		      "too many grid elements along some dimensions) "
+		      "for the requested traversal order");
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	memset(coords, 0, sizeof(int) * ndim);
+	X = (unsigned int *) R_alloc(ndim, sizeof(unsigned int));
+	elts = (KeyedElt *) R_alloc(grid_len, sizeof(KeyedElt));
+	for (i = 0; i < grid_len; i++) {
+		/* Coordinates go to 'X' in reverse order so the 1st
+		   dimension is the fastest moving one in Morton order. */
+		for (along = 0; along < ndim; along++)
+			X[ndim - 1 - along] = (unsigned int) coords[along];
+		if (hilbert)
+			axes_to_transpose(X, ndim, nbit);
+		elts[i].key = interleave_bits(X, ndim, nbit);
+		elts[i].id = i + 1;
+		next_coords(dim, ndim, coords);
+	}
+	qsort(elts, grid_len, sizeof(KeyedElt), compar_keys);
+	for (i = 0; i < grid_len; i++)
+		out[i] = elts[i].id;
+	return;
+}
+
+static void order_row_major(const int *dim, int ndim, int grid_len,
+			    int *out)
+{
+	int *coords, i, along, id, stride;
+
+	/* Same as column-major on the transposed grid. */
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	memset(coords, 0, sizeof(int) * ndim);
+	for (i = 0; i < grid_len; i++) {
+		id = 0;
+		stride = 1;
+		for (along = 0; along < ndim; along++) {
+			id += coords[along] * stride;
+			stride *= dim[along];
+		}
+		out[i] = id + 1;
+		for (along = ndim - 1; along >= 0; along--) {
+			if (++coords[along] < dim[along])
+				break;
+			coords[along] = 0;
+		}
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * gridOrder()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_gridOrder(SEXP dim, SEXP order)
+{
+	int ndim, along, grid_len, i, *out;
+	const int *dim_p;
+	double grid_len_dbl;
+	const char *order_str;
+	SEXP ans;
+
+	if (!IS_INTEGER(dim))
+		error("S4Arrays internal error in C_gridOrder():\n"
+		      "    'dim' must be an integer vector");
+	if (!(IS_CHARACTER(order) && LENGTH(order) == 1))
+		error("S4Arrays internal error in C_gridOrder():\n"
+		      "    'order' must be a single string");
+	ndim = LENGTH(dim);
+	dim_p = INTEGER(dim);
+	grid_len_dbl = 1.0;
+	for (along = 0; along < ndim; along++)
+		grid_len_dbl *= dim_p[along];
+	if (grid_len_dbl > INT_MAX)
+		error("gridOrder() does not support grids with more "
+		      "than .Machine$integer.max grid elements");
+	grid_len = (int) grid_len_dbl;
+	ans = PROTECT(NEW_INTEGER(grid_len));
+	out = INTEGER(ans);
+	order_str = CHAR(STRING_ELT(order, 0));
+	if (grid_len == 0) {
+		/* Nothing to do. */
+	} else if (strcmp(order_str, "column-major") == 0) {
+		for (i = 0; i < grid_len; i++)
+			out[i] = i + 1;
+	} else if (strcmp(order_str, "row-major") == 0) {
+		order_row_major(dim_p, ndim, grid_len, out);
+	} else if (strcmp(order_str, "morton") == 0) {
+		order_by_key(dim_p, ndim, grid_len, 0, out);
+	} else if (strcmp(order_str, "hilbert") == 0) {
+		order_by_key(dim_p, ndim, grid_len, 1, out);
+	} else {
+		error("S4Arrays internal error in C_gridOrder():\n"
+		      "    unsupported traversal order \"%s\"", order_str);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
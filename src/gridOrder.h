@@ -0,0 +1,9 @@
+#ifndef _GRIDORDER_H_
+#define _GRIDORDER_H_
+
+#include <Rdefines.h>
+
+SEXP C_gridOrder(SEXP dim, SEXP order);
+
+#endif  /* _GRIDORDER_H_ */
+
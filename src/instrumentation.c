@@ -0,0 +1,183 @@
+/****************************************************************************
+ *              Opt-in instrumentation of the .Call entry points            *
+ ****************************************************************************/
+
+/* Must be included before the R headers. */
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>    /* for clock_gettime() */
+#endif
+
+#include "instrumentation.h"
+
+#include "atomic_utils.h"
+
+#include <string.h>  /* for memset() */
+
+
+int S4Arrays_instrumentation_enabled = 0;
+
+/* Wall time in seconds from an arbitrary starting point. */
+double get_monotonic_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+/****************************************************************************
+ * Counters
+ *
+ * The entry points are always called from the main R thread (the threads
+ * started by the multithreaded kernels never go thru an entry point), so
+ * a single set of counters is enough and needs no synchronization.
+ * We use doubles to avoid overflows.
+ */
+
+typedef struct call_counters_t {
+	double ncall;
+	double nelt;    /* nb of elements in the returned object */
+	double nbyte;   /* size in bytes of the data of the returned object */
+	double time;    /* total wall time in seconds */
+} CallCounters;
+
+static const char * const *entry_point_names = NULL;
+static int num_entry_points = 0;
+static CallCounters *counters = NULL;
+
+/* Called by R_init_S4Arrays(). 'names' must be a static array. */
+void init_instrumentation(const char * const *names, int n)
+{
+	entry_point_names = names;
+	num_entry_points = n;
+	counters = (CallCounters *) R_Calloc(n, CallCounters);
+	return;
+}
+
+static void add_atomic_size(SEXP x, CallCounters *c)
+{
+	R_xlen_t n;
+	size_t eltsize;
+
+	if (!(isVectorAtomic(x) || isVectorList(x)))
+		return;
+	n = XLENGTH(x);
+	eltsize = isVectorAtomic(x) ? get_atomic_eltsize(TYPEOF(x)) : 0;
+	if (eltsize == 0)  /* character vector or list */
+		eltsize = sizeof(SEXP);
+	c->nelt += (double) n;
+	c->nbyte += (double) n * eltsize;
+	return;
+}
+
+/* For a list, we count the elements in its top-level elements (e.g. the
+   'major' and 'minor' components returned by mapToGrid()). */
+void record_entry_point_call(int id, SEXP ans, double t0)
+{
+	CallCounters *c = counters + id;
+	R_xlen_t i;
+
+	c->time += get_monotonic_time() - t0;
+	c->ncall += 1.0;
+	if (isVectorList(ans)) {
+		for (i = 0; i < XLENGTH(ans); i++)
+			add_atomic_size(VECTOR_ELT(ans, i), c);
+	} else {
+		add_atomic_size(ans, c);
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * .Call entry points (not instrumented)
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_instrumentation(void)
+{
+	return ScalarLogical(S4Arrays_instrumentation_enabled);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_set_instrumentation(SEXP enabled)
+{
+	int prev_enabled = S4Arrays_instrumentation_enabled;
+
+	if (!(IS_LOGICAL(enabled) && LENGTH(enabled) == 1 &&
+	      LOGICAL(enabled)[0] != NA_LOGICAL))
+		error("S4Arrays internal error in C_set_instrumentation():\n"
+		      "    'enabled' must be TRUE or FALSE");
+	S4Arrays_instrumentation_enabled = LOGICAL(enabled)[0];
+	return ScalarLogical(prev_enabled);
+}
+
+static SEXP new_counter_vector(int field)
+{
+	int i;
+	double v;
+	SEXP ans;
+
+	ans = PROTECT(NEW_NUMERIC(num_entry_points));
+	for (i = 0; i < num_entry_points; i++) {
+		const CallCounters *c = counters + i;
+		switch (field) {
+		    case 0: v = c->ncall; break;
+		    case 1: v = c->nelt; break;
+		    case 2: v = c->nbyte; break;
+		    default: v = c->time;
+		}
+		REAL(ans)[i] = v;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Return a list of 5 parallel vectors. */
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_instrumentation_counters(void)
+{
+	static const char * const ans_names[] = {
+		"entry_point", "ncall", "nelt", "nbyte", "time"
+	};
+	int i, field;
+	SEXP ans, ans_names_sxp, ans_elt;
+
+	ans = PROTECT(NEW_LIST(5));
+	ans_elt = PROTECT(NEW_CHARACTER(num_entry_points));
+	for (i = 0; i < num_entry_points; i++)
+		SET_STRING_ELT(ans_elt, i, mkChar(entry_point_names[i]));
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	for (field = 0; field < 4; field++)
+		SET_VECTOR_ELT(ans, field + 1, new_counter_vector(field));
+	ans_names_sxp = PROTECT(NEW_CHARACTER(5));
+	for (i = 0; i < 5; i++)
+		SET_STRING_ELT(ans_names_sxp, i, mkChar(ans_names[i]));
+	SET_NAMES(ans, ans_names_sxp);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_reset_instrumentation_counters(void)
+{
+	memset(counters, 0, sizeof(CallCounters) * num_entry_points);
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_monotonic_time(void)
+{
+	return ScalarReal(get_monotonic_time());
+}
+
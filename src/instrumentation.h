@@ -0,0 +1,26 @@
+#ifndef _INSTRUMENTATION_H_
+#define _INSTRUMENTATION_H_
+
+#include <Rdefines.h>
+
+/* Set with set_S4Arrays_instrumentation() at the R level. */
+extern int S4Arrays_instrumentation_enabled;
+
+double get_monotonic_time(void);
+
+void init_instrumentation(const char * const *names, int n);
+
+void record_entry_point_call(int id, SEXP ans, double t0);
+
+SEXP C_get_instrumentation(void);
+
+SEXP C_set_instrumentation(SEXP enabled);
+
+SEXP C_get_instrumentation_counters(void);
+
+SEXP C_reset_instrumentation_counters(void);
+
+SEXP C_monotonic_time(void);
+
+#endif  /* _INSTRUMENTATION_H_ */
+
@@ -0,0 +1,688 @@
+/****************************************************************************
+ *        Map reference array positions to grid positions and back          *
+ ****************************************************************************/
+#include "mapToGrid.h"
+
+#include <limits.h>  /* for INT_MAX */
+#include <math.h>    /* for trunc() */
+#include <string.h>  /* for memset() */
+
+
+/****************************************************************************
+ * Grid axes
+ *
+ * A GridAxis describes how the grid splits the reference array along a
+ * given dimension. The regular and arbitrary cases are described by
+ * 'spacing' and 'tickmarks', respectively (only one of the 2 is used).
+ */
+
+typedef struct grid_axis_t {
+	int refdim;             /* extent of the reference array */
+	int nblock;             /* extent of the grid */
+	int spacing;            /* regular grid, or -1 */
+	const int *tm;          /* arbitrary grid, or NULL */
+	int tm_len;
+} GridAxis;
+
+static void load_regular_axes(SEXP refdim, SEXP spacings, GridAxis *axes)
+{
+	int ndim, along, D, spacing;
+
+	ndim = LENGTH(refdim);
+	if (!IS_INTEGER(refdim) || !IS_INTEGER(spacings) ||
+	    LENGTH(spacings) != ndim)
+		error("S4Arrays internal error in load_regular_axes():\n"
+		      "    invalid 'refdim' or 'spacings'");
+	for (along = 0; along < ndim; along++) {
+		D = INTEGER(refdim)[along];
+		spacing = INTEGER(spacings)[along];
+		axes[along].refdim = D;
+		axes[along].spacing = spacing;
+		axes[along].tm = NULL;
+		axes[along].tm_len = 0;
+		/* Same as get_RegularArrayGrid_dim(). */
+		if (spacing == 0)
+			axes[along].nblock = 1;
+		else
+			axes[along].nblock = D / spacing + (D % spacing != 0);
+	}
+	return;
+}
+
+static void load_arbitrary_axes(SEXP tickmarks, GridAxis *axes)
+{
+	int ndim, along, tm_len;
+	SEXP tm;
+
+	ndim = LENGTH(tickmarks);
+	for (along = 0; along < ndim; along++) {
+		tm = VECTOR_ELT(tickmarks, along);
+		if (!IS_INTEGER(tm))
+			error("S4Arrays internal error in "
+			      "load_arbitrary_axes():\n"
+			      "    'tickmarks[[%d]]' is not an integer vector",
+			      along + 1);
+		tm_len = LENGTH(tm);
+		axes[along].tm = INTEGER(tm);
+		axes[along].tm_len = tm_len;
+		axes[along].refdim = tm_len == 0 ? 0 : INTEGER(tm)[tm_len - 1];
+		axes[along].nblock = tm_len;
+		axes[along].spacing = -1;
+	}
+	return;
+}
+
+/* Extent along the axis of the grid element at 0-based position 'major0'
+   ('major0' must be valid). */
+static inline int get_block_extent(const GridAxis *axis, int major0)
+{
+	if (axis->tm == NULL) {
+		int end = axis->refdim - major0 * axis->spacing;
+		return end < axis->spacing ? end : axis->spacing;
+	}
+	return axis->tm[major0] - (major0 == 0 ? 0 : axis->tm[major0 - 1]);
+}
+
+/* Offset along the axis of the grid element at 0-based position 'major0'
+   ('major0' must be valid). */
+static inline int get_block_offset(const GridAxis *axis, int major0)
+{
+	if (axis->tm == NULL)
+		return major0 * axis->spacing;
+	return major0 == 0 ? 0 : axis->tm[major0 - 1];
+}
+
+
+/****************************************************************************
+ * Mapping a column of an M-index to the grid
+ *
+ * map_column() fills the 'major' and 'minor' columns (1-based) that
+ * correspond to the 'M' column. Like the original R implementation of
+ * mapToGrid(), it doesn't do any bounds checking:
+ *   - Along a regular axis, major = 1 + (m - 1) %/% spacing and
+ *     minor = 1 + (m - 1) %% spacing. The integer division by the spacing
+ *     is replaced with a multiplication by its reciprocal (rounded to the
+ *     nearest integer) followed by a one-step correction. This is the same
+ *     trick as in L2M_fast().
+ *   - Along an arbitrary axis, the grid element is found by binary search
+ *     of the tickmarks. Since consecutive M-index rows often fall in the
+ *     same grid element, the element found for the previous row is tried
+ *     first.
+ */
+
+/* Adding and subtracting 1.5 * 2^52 rounds a double in [-2^51, 2^51] to
+   the nearest integer. */
+#define	ROUNDING_MAGIC 6755399441055744.0  /* 1.5 * 2^52 */
+
+static void map_column_to_regular_axis(const GridAxis *axis,
+		const int *M, R_xlen_t n, int *major, int *minor)
+{
+	R_xlen_t k;
+
+	if (axis->spacing == 0) {
+		/* Like '(m - 1L) %/% 0L' and '(m - 1L) %% 0L'. */
+		for (k = 0; k < n; k++)
+			major[k] = minor[k] = NA_INTEGER;
+		return;
+	}
+	double d = (double) axis->spacing, inv_d = 1.0 / d;
+	for (k = 0; k < n; k++) {
+		int m = M[k];
+		if (m == NA_INTEGER) {
+			major[k] = minor[k] = NA_INTEGER;
+			continue;
+		}
+		double x = (double) m - 1.0;
+		double q = x * inv_d + ROUNDING_MAGIC;
+		q -= ROUNDING_MAGIC;
+		double r = x - q * d;
+		/* 'r' is in [-d, 2 * d) so 'c' below is floor(r / d). */
+		double c = (r + 0.5) * inv_d - 0.5 + ROUNDING_MAGIC;
+		c -= ROUNDING_MAGIC;
+		q += c;
+		r -= c * d;
+		major[k] = (int) q + 1;
+		minor[k] = (int) r + 1;
+	}
+	return;
+}
+
+/* Return the nb of tickmarks that are < m. */
+static inline int count_tickmarks_below(const int *tm, int tm_len, int m)
+{
+	int lo = 0, hi = tm_len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tm[mid] < m)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void map_column_to_arbitrary_axis(const GridAxis *axis,
+		const int *M, R_xlen_t n, int *major, int *minor)
+{
+	R_xlen_t k;
+	const int *tm = axis->tm;
+	int tm_len = axis->tm_len, j = 0;
+
+	for (k = 0; k < n; k++) {
+		int m = M[k];
+		if (m == NA_INTEGER) {
+			major[k] = minor[k] = NA_INTEGER;
+			continue;
+		}
+		/* Try the grid element of the previous row first. */
+		if (!((j == 0 || tm[j - 1] < m) && (j == tm_len || tm[j] >= m)))
+			j = count_tickmarks_below(tm, tm_len, m);
+		major[k] = j + 1;
+		/* Positions beyond the last tickmark don't belong to any
+		   grid element. */
+		minor[k] = j == tm_len ? NA_INTEGER
+				       : m - (j == 0 ? 0 : tm[j - 1]);
+	}
+	return;
+}
+
+static void map_column(const GridAxis *axis,
+		const int *M, R_xlen_t n, int *major, int *minor)
+{
+	if (axis->tm == NULL)
+		map_column_to_regular_axis(axis, M, n, major, minor);
+	else
+		map_column_to_arbitrary_axis(axis, M, n, major, minor);
+	return;
+}
+
+
+/****************************************************************************
+ * mapToGrid()
+ */
+
+/* Number of M-index rows processed at a time when 'linear' is TRUE. */
+#define	MAP_BLOCK_SIZE 1024
+
+static SEXP new_major_minor_list(SEXP major, SEXP minor)
+{
+	SEXP ans, ans_names;
+
+	ans = PROTECT(NEW_LIST(2));
+	SET_VECTOR_ELT(ans, 0, major);
+	SET_VECTOR_ELT(ans, 1, minor);
+	ans_names = PROTECT(NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("major"));
+	SET_STRING_ELT(ans_names, 1, mkChar("minor"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* Compute the 'major' and 'minor' L-indices of 'n' consecutive rows of
+   the M-index. 'M' must point to the first of these rows and 'ld' is the
+   nb of rows of the M-index. 'n' must be <= MAP_BLOCK_SIZE. The linear
+   indices are accumulated from the last to the first dimension (Horner's
+   method) so the M-index is read column by column. 'i0' is only used to
+   report the position of invalid rows. */
+static void map_Mindex_rows_to_linear(const GridAxis *axes, int ndim,
+		const int *M, R_xlen_t ld, int n, R_xlen_t i0,
+		int *major_int, double *major_dbl, int *minor)
+{
+	int k, along;
+	int maj[MAP_BLOCK_SIZE], mnr[MAP_BLOCK_SIZE];
+	double Lmaj[MAP_BLOCK_SIZE];
+	long long int Lmin[MAP_BLOCK_SIZE];
+
+	for (k = 0; k < n; k++) {
+		Lmaj[k] = 0.0;
+		Lmin[k] = 0;
+	}
+	for (along = ndim - 1; along >= 0; along--) {
+		const GridAxis *axis = axes + along;
+		map_column(axis, M + ld * along, n, maj, mnr);
+		for (k = 0; k < n; k++) {
+			int major0 = maj[k] - 1, minor0 = mnr[k] - 1;
+			if (maj[k] == NA_INTEGER || mnr[k] == NA_INTEGER ||
+			    major0 < 0 || major0 >= axis->nblock ||
+			    minor0 < 0 ||
+			    minor0 >= get_block_extent(axis, major0))
+				error("when 'linear=TRUE', 'Mindex' cannot "
+				      "contain NAs or positions that fall "
+				      "outside the grid (Mindex[%lld, %d] "
+				      "does)", (long long int) (i0 + k + 1),
+				      along + 1);
+			Lmaj[k] = Lmaj[k] * axis->nblock + major0;
+			Lmin[k] = Lmin[k] * get_block_extent(axis, major0) +
+				  minor0;
+		}
+	}
+	for (k = 0; k < n; k++) {
+		if (major_int != NULL)
+			major_int[k] = (int) Lmaj[k] + 1;
+		else
+			major_dbl[k] = Lmaj[k] + 1.0;
+		minor[k] = (int) Lmin[k] + 1;
+	}
+	return;
+}
+
+/* Fill the 'major' and 'minor' L-indices by processing the M-index by
+   blocks of MAP_BLOCK_SIZE rows. Only one of 'major_int' or 'major_dbl'
+   must be NULL. */
+static void map_Mindex_to_linear(const GridAxis *axes, int ndim,
+		const int *M, R_xlen_t nrow,
+		int *major_int, double *major_dbl, int *minor)
+{
+	R_xlen_t i0;
+	int n;
+
+	for (i0 = 0; i0 < nrow; i0 += MAP_BLOCK_SIZE) {
+		n = nrow - i0 < MAP_BLOCK_SIZE ? (int) (nrow - i0)
+					       : MAP_BLOCK_SIZE;
+		map_Mindex_rows_to_linear(axes, ndim, M + i0, nrow, n, i0,
+			major_int != NULL ? major_int + i0 : NULL,
+			major_dbl != NULL ? major_dbl + i0 : NULL,
+			minor + i0);
+	}
+	return;
+}
+
+static double get_grid_length(const GridAxis *axes, int ndim)
+{
+	double grid_len = 1.0;
+
+	for (int along = 0; along < ndim; along++)
+		grid_len *= axes[along].nblock;
+	return grid_len;
+}
+
+static SEXP map_Mindex_to_grid(SEXP Mindex, const GridAxis *axes, int ndim,
+			       SEXP linear)
+{
+	R_xlen_t nrow;
+	int along;
+	double grid_len;
+	SEXP major, minor, ans;
+
+	if (!(IS_INTEGER(Mindex) && isMatrix(Mindex) &&
+	      INTEGER(GET_DIM(Mindex))[1] == ndim))
+		error("S4Arrays internal error in map_Mindex_to_grid():\n"
+		      "    'Mindex' must be an integer matrix with one column "
+		      "per dimension");
+	nrow = INTEGER(GET_DIM(Mindex))[0];
+	const int *M = INTEGER(Mindex);
+	if (LOGICAL(linear)[0]) {
+		/* Like Mindex2Lindex(major, dim(grid)), the major L-index is
+		   returned as an integer vector if the grid has less than
+		   2^31 elements. */
+		grid_len = get_grid_length(axes, ndim);
+		major = PROTECT(allocVector(grid_len <= INT_MAX ? INTSXP
+								: REALSXP,
+					    nrow));
+		minor = PROTECT(NEW_INTEGER(nrow));
+		map_Mindex_to_linear(axes, ndim, M, nrow,
+			IS_INTEGER(major) ? INTEGER(major) : NULL,
+			IS_INTEGER(major) ? NULL : REAL(major),
+			INTEGER(minor));
+	} else {
+		major = PROTECT(allocMatrix(INTSXP, nrow, ndim));
+		minor = PROTECT(allocMatrix(INTSXP, nrow, ndim));
+		for (along = 0; along < ndim; along++)
+			map_column(axes + along, M + nrow * along, nrow,
+				   INTEGER(major) + nrow * along,
+				   INTEGER(minor) + nrow * along);
+		SET_DIMNAMES(major, GET_DIMNAMES(Mindex));
+		SET_DIMNAMES(minor, GET_DIMNAMES(Mindex));
+	}
+	ans = new_major_minor_list(major, minor);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_mapToGrid_RegularArrayGrid(SEXP Mindex, SEXP refdim, SEXP spacings,
+				  SEXP linear)
+{
+	int ndim = LENGTH(refdim);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_regular_axes(refdim, spacings, axes);
+	return map_Mindex_to_grid(Mindex, axes, ndim, linear);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_mapToGrid_ArbitraryArrayGrid(SEXP Mindex, SEXP tickmarks,
+				    SEXP linear)
+{
+	int ndim = LENGTH(tickmarks);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_arbitrary_axes(tickmarks, axes);
+	return map_Mindex_to_grid(Mindex, axes, ndim, linear);
+}
+
+
+/****************************************************************************
+ * mapToRef()
+ */
+
+/* 'major' and 'minor' can be integer or numeric vectors. They've been
+   checked at the R level to be of the same length and to not contain
+   values < 1. */
+static void map_linear_to_ref(const GridAxis *axes, int ndim,
+		SEXP major, SEXP minor, int *ans, R_xlen_t nrow)
+{
+	R_xlen_t i;
+	int along;
+	double grid_len, x, y, q;
+
+	grid_len = get_grid_length(axes, ndim);
+	for (i = 0; i < nrow; i++) {
+		x = IS_INTEGER(major) ?
+			(INTEGER(major)[i] == NA_INTEGER ? NA_REAL
+					: (double) INTEGER(major)[i]) :
+			REAL(major)[i];
+		y = IS_INTEGER(minor) ?
+			(INTEGER(minor)[i] == NA_INTEGER ? NA_REAL
+					: (double) INTEGER(minor)[i]) :
+			REAL(minor)[i];
+		/* Comparisons with NA or NaN are false. */
+		if (!(x >= 1.0 && x < grid_len + 1.0))
+			error("when 'linear=TRUE', 'major' cannot contain "
+			      "NAs or values > length(grid) (major[%lld] "
+			      "does)", (long long int) (i + 1));
+		if (!(y >= 1.0))
+			error("when 'linear=TRUE', 'minor' cannot contain "
+			      "NAs (minor[%lld] is NA)", (long long int) (i + 1));
+		x = trunc(x) - 1.0;
+		y = trunc(y) - 1.0;
+		for (along = 0; along < ndim; along++) {
+			const GridAxis *axis = axes + along;
+			q = trunc(x / axis->nblock);
+			int major0 = (int) (x - q * axis->nblock);
+			x = q;
+			int extent = get_block_extent(axis, major0);
+			if (extent == 0)
+				break;
+			q = trunc(y / extent);
+			int minor0 = (int) (y - q * extent);
+			y = q;
+			ans[nrow * along + i] =
+				get_block_offset(axis, major0) + minor0 + 1;
+		}
+		/* What's left of 'y' must be 0. */
+		if (along < ndim || y != 0.0)
+			error("when 'linear=TRUE', 'minor' cannot contain "
+			      "values > the length of the grid element "
+			      "selected by 'major' (minor[%lld] does)",
+			      (long long int) (i + 1));
+	}
+	return;
+}
+
+/* Like the original R implementation of mapToRef(), the values in
+   'major' and 'minor' are not checked. Positions that cannot be mapped
+   (e.g. because they contain NAs) are mapped to NA. */
+static void map_Mindex_to_ref(const GridAxis *axes, int ndim,
+		const int *major, const int *minor, int *ans, R_xlen_t nrow)
+{
+	R_xlen_t i, k;
+	int along;
+
+	for (along = 0; along < ndim; along++) {
+		const GridAxis *axis = axes + along;
+		for (i = 0; i < nrow; i++) {
+			k = nrow * along + i;
+			int maj = major[k], mnr = minor[k];
+			if (axis->tm != NULL && axis->tm_len == 0) {
+				ans[k] = mnr;
+				continue;
+			}
+			if (maj == NA_INTEGER || mnr == NA_INTEGER) {
+				ans[k] = NA_INTEGER;
+				continue;
+			}
+			long long int offset;
+			if (axis->tm == NULL) {
+				offset = ((long long int) maj - 1) *
+					 axis->spacing;
+			} else if (maj >= 1 && maj <= axis->tm_len) {
+				offset = get_block_offset(axis, maj - 1);
+			} else {
+				ans[k] = NA_INTEGER;
+				continue;
+			}
+			offset += mnr;
+			ans[k] = offset > INT_MAX || offset <= -INT_MAX ?
+					NA_INTEGER : (int) offset;
+		}
+	}
+	return;
+}
+
+static SEXP map_grid_to_ref(SEXP major, SEXP minor,
+			    const GridAxis *axes, int ndim, SEXP linear)
+{
+	R_xlen_t nrow;
+	SEXP ans;
+
+	if (LOGICAL(linear)[0]) {
+		nrow = XLENGTH(major);
+		if (nrow > INT_MAX)
+			error("when 'linear=TRUE', 'major' and 'minor' "
+			      "cannot be long vectors");
+		ans = PROTECT(allocMatrix(INTSXP, nrow, ndim));
+		map_linear_to_ref(axes, ndim, major, minor, INTEGER(ans), nrow);
+	} else {
+		if (!(IS_INTEGER(major) && IS_INTEGER(minor) &&
+		      isMatrix(major) && isMatrix(minor) &&
+		      INTEGER(GET_DIM(major))[1] == ndim &&
+		      XLENGTH(major) == XLENGTH(minor)))
+			error("S4Arrays internal error in map_grid_to_ref():\n"
+			      "    'major' and 'minor' must be integer "
+			      "matrices with one column per dimension");
+		nrow = INTEGER(GET_DIM(major))[0];
+		ans = PROTECT(allocMatrix(INTSXP, nrow, ndim));
+		map_Mindex_to_ref(axes, ndim, INTEGER(major), INTEGER(minor),
+				  INTEGER(ans), nrow);
+		SET_DIMNAMES(ans, GET_DIMNAMES(minor));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_mapToRef_RegularArrayGrid(SEXP major, SEXP minor,
+				 SEXP refdim, SEXP spacings, SEXP linear)
+{
+	int ndim = LENGTH(refdim);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_regular_axes(refdim, spacings, axes);
+	return map_grid_to_ref(major, minor, axes, ndim, linear);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_mapToRef_ArbitraryArrayGrid(SEXP major, SEXP minor,
+				   SEXP tickmarks, SEXP linear)
+{
+	int ndim = LENGTH(tickmarks);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_arbitrary_axes(tickmarks, axes);
+	return map_grid_to_ref(major, minor, axes, ndim, linear);
+}
+
+
+/****************************************************************************
+ * bucketToGrid()
+ *
+ * Counting sort of the elements of an M-index or L-index by grid element.
+ * The result is in CSR form:
+ *   - 'offsets': A vector of length 'length(grid) + 1' where
+ *     'offsets[b] + 1' to 'offsets[b + 1]' are the positions in 'perm'
+ *     of the elements that fall in grid element b.
+ *   - 'perm': The positions of the elements in the input M-index (i.e.
+ *     its row numbers) or L-index, ordered by grid element. Elements that
+ *     fall in the same grid element are kept in their original order.
+ *   - 'minor': The linear positions of the elements within their grid
+ *     element, in the order of 'perm'.
+ * The M-index or L-index is walked once to compute the grid element and
+ * linear minor index of each element, then once more to distribute them.
+ */
+
+static void fill_block_of_coords(const GridAxis *axes, int ndim,
+		SEXP Lindex, R_xlen_t i0, int n, double refdim_prod, int *M)
+{
+	int k, along;
+	double v;
+	long long int x;
+
+	for (k = 0; k < n; k++) {
+		if (IS_INTEGER(Lindex)) {
+			int L = INTEGER(Lindex)[i0 + k];
+			v = L == NA_INTEGER ? NA_REAL : (double) L;
+		} else {
+			v = REAL(Lindex)[i0 + k];
+		}
+		/* Comparisons with NA or NaN are false. */
+		if (!(v >= 1.0 && v < refdim_prod + 1.0))
+			error("'index' contains NAs or L-index values that "
+			      "are < 1 or > prod(refdim(grid)) "
+			      "(index[%lld] does)", (long long int) (i0 + k + 1));
+		x = (long long int) v - 1;
+		for (along = 0; along < ndim; along++) {
+			int d = axes[along].refdim;
+			M[MAP_BLOCK_SIZE * along + k] = (int) (x % d) + 1;
+			x /= d;
+		}
+	}
+	return;
+}
+
+/* Coordinates of the elements of an L-index fall in the reference array so
+   always in the grid. */
+static void map_Lindex_to_linear(const GridAxis *axes, int ndim,
+		SEXP Lindex, int *major, int *minor)
+{
+	R_xlen_t nelt, i0;
+	int n, along;
+	double refdim_prod;
+
+	nelt = XLENGTH(Lindex);
+	refdim_prod = 1.0;
+	for (along = 0; along < ndim; along++)
+		refdim_prod *= axes[along].refdim;
+	int *M = (int *) R_alloc((size_t) MAP_BLOCK_SIZE * ndim, sizeof(int));
+	for (i0 = 0; i0 < nelt; i0 += MAP_BLOCK_SIZE) {
+		n = nelt - i0 < MAP_BLOCK_SIZE ? (int) (nelt - i0)
+					       : MAP_BLOCK_SIZE;
+		fill_block_of_coords(axes, ndim, Lindex, i0, n, refdim_prod, M);
+		map_Mindex_rows_to_linear(axes, ndim, M, MAP_BLOCK_SIZE, n, i0,
+					  major + i0, NULL, minor + i0);
+	}
+	return;
+}
+
+static SEXP new_xint_vector(R_xlen_t len, R_xlen_t max_val)
+{
+	return allocVector(max_val <= INT_MAX ? INTSXP : REALSXP, len);
+}
+
+static inline void set_xint_elt(SEXP x, R_xlen_t i, R_xlen_t val)
+{
+	if (IS_INTEGER(x))
+		INTEGER(x)[i] = (int) val;
+	else
+		REAL(x)[i] = (double) val;
+}
+
+static SEXP bucket_to_grid(SEXP index, const GridAxis *axes, int ndim)
+{
+	R_xlen_t nelt, i, p;
+	int grid_len, b;
+	double grid_len_dbl;
+	SEXP ans_offsets, ans_perm, ans_minor, ans, ans_names;
+
+	grid_len_dbl = get_grid_length(axes, ndim);
+	if (grid_len_dbl > INT_MAX)
+		error("bucketToGrid() does not support grids with more "
+		      "than .Machine$integer.max grid elements");
+	grid_len = (int) grid_len_dbl;
+
+	/* 1st pass: compute the grid element and linear minor index of
+	   each element. */
+	if (isMatrix(index)) {
+		if (!IS_INTEGER(index) || INTEGER(GET_DIM(index))[1] != ndim)
+			error("S4Arrays internal error in bucket_to_grid():\n"
+			      "    'index' must be an integer matrix with "
+			      "one column per dimension");
+		nelt = INTEGER(GET_DIM(index))[0];
+	} else {
+		if (!(IS_INTEGER(index) || IS_NUMERIC(index)))
+			error("S4Arrays internal error in bucket_to_grid():\n"
+			      "    'index' must be a numeric vector");
+		nelt = XLENGTH(index);
+	}
+	int *major = (int *) R_alloc(nelt, sizeof(int));
+	ans_minor = PROTECT(NEW_INTEGER(nelt));
+	int *minor = (int *) R_alloc(nelt, sizeof(int));
+	if (isMatrix(index)) {
+		map_Mindex_to_linear(axes, ndim, INTEGER(index), nelt,
+				     major, NULL, minor);
+	} else {
+		map_Lindex_to_linear(axes, ndim, index, major, minor);
+	}
+
+	/* Count the elements in each grid element and turn the counts
+	   into offsets. After this, 'offsets[b]' is the offset of grid
+	   element b + 1 (0-based). */
+	R_xlen_t *offsets = (R_xlen_t *) R_alloc((size_t) grid_len + 1,
+						 sizeof(R_xlen_t));
+	memset(offsets, 0, sizeof(R_xlen_t) * ((size_t) grid_len + 1));
+	for (i = 0; i < nelt; i++)
+		offsets[major[i]]++;
+	for (b = 1; b <= grid_len; b++)
+		offsets[b] += offsets[b - 1];
+
+	/* 2nd pass: distribute the elements. 'offsets[b - 1]' is used as
+	   the cursor of grid element b so ends up being its end. */
+	ans_perm = PROTECT(new_xint_vector(nelt, nelt));
+	for (i = 0; i < nelt; i++) {
+		p = offsets[major[i] - 1]++;
+		set_xint_elt(ans_perm, p, i + 1);
+		INTEGER(ans_minor)[p] = minor[i];
+	}
+	ans_offsets = PROTECT(new_xint_vector((R_xlen_t) grid_len + 1, nelt));
+	set_xint_elt(ans_offsets, 0, 0);
+	for (b = 0; b < grid_len; b++)
+		set_xint_elt(ans_offsets, b + 1, offsets[b]);
+
+	ans = PROTECT(NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, ans_offsets);
+	SET_VECTOR_ELT(ans, 1, ans_perm);
+	SET_VECTOR_ELT(ans, 2, ans_minor);
+	ans_names = PROTECT(NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("offsets"));
+	SET_STRING_ELT(ans_names, 1, mkChar("perm"));
+	SET_STRING_ELT(ans_names, 2, mkChar("minor"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(5);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_bucketToGrid_RegularArrayGrid(SEXP index, SEXP refdim, SEXP spacings)
+{
+	int ndim = LENGTH(refdim);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_regular_axes(refdim, spacings, axes);
+	return bucket_to_grid(index, axes, ndim);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_bucketToGrid_ArbitraryArrayGrid(SEXP index, SEXP tickmarks)
+{
+	int ndim = LENGTH(tickmarks);
+	GridAxis *axes = (GridAxis *) R_alloc(ndim, sizeof(GridAxis));
+	load_arbitrary_axes(tickmarks, axes);
+	return bucket_to_grid(index, axes, ndim);
+}
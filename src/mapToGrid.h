@@ -0,0 +1,24 @@
+#ifndef _MAPTOGRID_H_
+#define _MAPTOGRID_H_
+
+#include <Rdefines.h>
+
+SEXP C_mapToGrid_RegularArrayGrid(SEXP Mindex, SEXP refdim, SEXP spacings,
+				  SEXP linear);
+
+SEXP C_mapToGrid_ArbitraryArrayGrid(SEXP Mindex, SEXP tickmarks,
+				    SEXP linear);
+
+SEXP C_mapToRef_RegularArrayGrid(SEXP major, SEXP minor,
+				 SEXP refdim, SEXP spacings, SEXP linear);
+
+SEXP C_mapToRef_ArbitraryArrayGrid(SEXP major, SEXP minor,
+				   SEXP tickmarks, SEXP linear);
+
+SEXP C_bucketToGrid_RegularArrayGrid(SEXP index, SEXP refdim,
+				     SEXP spacings);
+
+SEXP C_bucketToGrid_ArbitraryArrayGrid(SEXP index, SEXP tickmarks);
+
+#endif  /* _MAPTOGRID_H_ */
+
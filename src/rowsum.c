@@ -1,10 +1,12 @@
 /****************************************************************************
- *                        C_rowsum() and C_colsum()                         *
+ *          C_rowsum(), C_colsum(), C_rowstats(), and C_colstats()          *
  ****************************************************************************/
 #include "rowsum.h"
 
 #include "S4Vectors_interface.h"
 
+#include "thread_control.h"
+
 #include <limits.h>  /* for INT_MAX */
 
 
@@ -13,12 +15,13 @@ static void check_group(SEXP group, int x_nrow, int ngroup)
 	if (!IS_INTEGER(group))
 		error("the grouping vector must be "
 		      "an integer vector or factor");
-	if (LENGTH(group) != x_nrow)
+	if (XLENGTH(group) != x_nrow)
 		error("the grouping vector must have one element "
 		      "per row in 'x' for rowsum()\n  and one element "
 		      "per column in 'x' for colsum()");
-	for (int i = 0; i < x_nrow; i++) {
-		int g = INTEGER(group)[i];
+	const int *groups = INTEGER(group);
+	for (R_xlen_t i = 0; i < x_nrow; i++) {
+		int g = groups[i];
 		if (g == NA_INTEGER) {
 			if (ngroup < 1)
 				error("'ngroup' must be >= 1 when 'group' "
@@ -32,55 +35,81 @@ static void check_group(SEXP group, int x_nrow, int ngroup)
 	return;
 }
 
-static void compute_rowsum_double(const double *x, int x_nrow, int x_ncol,
-		const int *groups, int narm, double *out, int out_nrow)
+/* The matrix of results is allowed to be a long vector. */
+static void check_ans_len(int ans_nrow, int ans_ncol, const char *what)
 {
-	memset(out, 0, sizeof(double) * out_nrow * x_ncol);
-	error("compute_rowsum_double() is not ready");
+	if ((double) ans_nrow * ans_ncol > (double) R_XLEN_T_MAX)
+		error("too many groups (%s will be too big)", what);
 	return;
 }
 
-static void compute_rowsum_int(const int *x, int x_nrow, int x_ncol,
-		const int *groups, int narm, int *out, int out_nrow)
+/* Turn the 1-based group ids into 0-based row indices in the matrix of
+   sums (NAs go to the last row). We do this once upfront so that the
+   inner loops of the rowsum kernels below don't need to deal with NAs
+   or 1-base vs 0-base. */
+static const int *map_groups_to_out_rows(const int *groups, int x_nrow,
+		int out_nrow)
 {
-	memset(out, 0, sizeof(int) * out_nrow * x_ncol);
-	error("compute_rowsum_int() is not ready");
-	return;
+	int *out_rows = (int *) R_alloc(x_nrow, sizeof(int));
+	for (int i = 0; i < x_nrow; i++) {
+		int g = groups[i];
+		out_rows[i] = g == NA_INTEGER ? out_nrow - 1 : g - 1;
+	}
+	return out_rows;
 }
 
-static void compute_colsum_double(const double *x, int x_nrow, int x_ncol,
-		const int *groups, int narm, double *out, int out_ncol)
+/* Multithreading
+   --------------
+   The kernels below split the work along a dimension of the input that
+   maps to a dimension of the output so that each thread writes to its own
+   region of 'out'. For rowsum() we split along the columns (output column
+   j only depends on input column j). For colsum() we split along the rows
+   (output row i only depends on input row i). Therefore no partial buffers
+   need to be merged, and, since every output value is obtained by adding
+   the same input values in the same order, the result is bit-for-bit
+   identical to what we get with a single thread, whatever 'nthread' is.
+   The threads never call error() or warning(). Integer overflows are
+   recorded in the 'overflow' variable which is OR-reduced across threads,
+   and the warning is issued only once by the caller's thread.
+   See thread_control.h for compute_nchunk() and CHUNK_START(). */
+
+/* We walk on 'x' one column at a time and scatter the values of each
+   column into the corresponding column of 'out'. So 'x' is read
+   sequentially and only once, and, at any given time, the output tile
+   that is being written to is the current column of 'out', that is,
+   a contiguous chunk of 'out_nrow' values. With a reasonable number
+   of groups this tile stays in L1/L2 while we're walking on the column
+   of 'x'. */
+static void rowsum_double_cols(const double *x, int x_nrow,
+		const int *out_rows, int narm, double *out, int out_nrow,
+		int j1, int j2)
 {
-	memset(out, 0, sizeof(double) * x_nrow * out_ncol);
-	for (int j = 0; j < x_ncol; j++) {
-		int g = groups[j];
-		if (g == NA_INTEGER)
-			g = out_ncol;
-		g--;  // from 1-base to 0-base
-		double *out_p = out + g * x_nrow;
-		for (int i = 0; i < x_nrow; i++, x++, out_p++) {
+	x += (R_xlen_t) x_nrow * j1;
+	out += (R_xlen_t) out_nrow * j1;
+	for (int j = j1; j < j2; j++, out += out_nrow) {
+		for (int i = 0; i < x_nrow; i++, x++) {
 			/* ISNAN(): True for *both* NA and NaN.
 			   See <R_ext/Arith.h> */
 			if (narm && ISNAN(*x))
 				continue;
-			*out_p += *x;
+			out[out_rows[i]] += *x;
 		}
 	}
 	return;
 }
 
-static void compute_colsum_int(const int *x, int x_nrow, int x_ncol,
-		const int *groups, int narm, int *out, int out_ncol)
+/* Same walk as rowsum_double_cols() above. NAs and integer overflows
+   are treated like in base::rowsum(). */
+static int rowsum_int_cols(const int *x, int x_nrow,
+		const int *out_rows, int narm, int *out, int out_nrow,
+		int j1, int j2)
 {
-	memset(out, 0, sizeof(int) * x_nrow * out_ncol);
 	int overflow = 0;
-	for (int j = 0; j < x_ncol; j++) {
-		int g = groups[j];
-		if (g == NA_INTEGER)
-			g = out_ncol;
-		g--;  // from 1-base to 0-base
-		int *out_p = out + g * x_nrow;
-		for (int i = 0; i < x_nrow; i++, x++, out_p++) {
+	x += (R_xlen_t) x_nrow * j1;
+	out += (R_xlen_t) out_nrow * j1;
+	for (int j = j1; j < j2; j++, out += out_nrow) {
+		for (int i = 0; i < x_nrow; i++, x++) {
+			int *out_p = out + out_rows[i];
 			if (*out_p == NA_INTEGER)
 				continue;
 			if (*x == NA_INTEGER) {
@@ -97,6 +126,277 @@ static void compute_colsum_int(const int *x, int x_nrow, int x_ncol,
 			}
 		}
 	}
+	return overflow;
+}
+
+static void compute_rowsum_double(const double *x, int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_nrow,
+		int nthread)
+{
+	memset(out, 0, sizeof(double) * (R_xlen_t) out_nrow * x_ncol);
+	if (x_nrow == 0)
+		return;
+	const int *out_rows = map_groups_to_out_rows(groups, x_nrow, out_nrow);
+	int nchunk = compute_nchunk(nthread, x_ncol,
+				    (R_xlen_t) x_nrow * x_ncol);
+	#pragma omp parallel for num_threads(nchunk) schedule(static)
+	for (int k = 0; k < nchunk; k++)
+		rowsum_double_cols(x, x_nrow, out_rows, narm, out, out_nrow,
+				   CHUNK_START(k, x_ncol, nchunk),
+				   CHUNK_START(k + 1, x_ncol, nchunk));
+	return;
+}
+
+static void compute_rowsum_int(const int *x, int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_nrow,
+		int nthread)
+{
+	memset(out, 0, sizeof(int) * (R_xlen_t) out_nrow * x_ncol);
+	if (x_nrow == 0)
+		return;
+	const int *out_rows = map_groups_to_out_rows(groups, x_nrow, out_nrow);
+	int nchunk = compute_nchunk(nthread, x_ncol,
+				    (R_xlen_t) x_nrow * x_ncol);
+	int overflow = 0;
+	#pragma omp parallel for num_threads(nchunk) schedule(static) \
+		reduction(|:overflow)
+	for (int k = 0; k < nchunk; k++)
+		overflow |= rowsum_int_cols(x, x_nrow, out_rows, narm,
+					    out, out_nrow,
+					    CHUNK_START(k, x_ncol, nchunk),
+					    CHUNK_START(k + 1, x_ncol, nchunk));
+	if (overflow)
+		warning("NAs produced by integer overflow");
+	return;
+}
+
+/* Vectorized colsum() kernels and CPU dispatch
+   --------------------------------------------
+   The inner loops of the colsum() kernels are written without branches
+   and annotated with '#pragma omp simd' so that they get vectorized.
+   In the 'na.rm=TRUE' case NAs and NaNs are masked i.e. they get replaced
+   with zeros before being added. Integer sums are accumulated in a wide
+   (64-bit) buffer that cannot overflow, and a per-cell status flag records
+   whether an NA was seen or an intermediate sum didn't fit in an int. The
+   flags are turned into NAs after all the columns have been processed.
+   This gives the same result as rowsum_int_cols() above (i.e. as
+   base::rowsum()), where a sum that overflows at some point is NA even if
+   it would fit in an int in the end.
+
+   Each kernel is compiled twice: once for the baseline instruction set of
+   the target platform (SSE2 on x86_64, NEON on arm64), and, on x86, once
+   more with AVX2 enabled. The AVX2 variants are selected at load time by
+   init_rowsum_kernels() if the CPU supports them. */
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define	HAVE_AVX2_KERNELS 1
+#endif
+
+#define	KERNEL_INLINE static inline __attribute__((always_inline))
+
+/* Process rows i1 <= i < i2 of 'x'. */
+KERNEL_INLINE void colsum_double_rows_body(const double *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_ncol,
+		int i1, int i2)
+{
+	int n = i2 - i1;
+	for (int j = 0; j < x_ncol; j++) {
+		int g = groups[j];
+		if (g == NA_INTEGER)
+			g = out_ncol;
+		g--;  // from 1-base to 0-base
+		const double *restrict x_p = x + (R_xlen_t) j * x_nrow + i1;
+		double *restrict out_p = out + (R_xlen_t) g * x_nrow + i1;
+		if (narm) {
+			/* ISNAN(): True for *both* NA and NaN.
+			   See <R_ext/Arith.h> */
+			#pragma omp simd
+			for (int i = 0; i < n; i++)
+				out_p[i] += ISNAN(x_p[i]) ? 0.0 : x_p[i];
+		} else {
+			#pragma omp simd
+			for (int i = 0; i < n; i++)
+				out_p[i] += x_p[i];
+		}
+	}
+	return;
+}
+
+/* Values of the status flags used by the integer colsum() kernel. */
+#define	SUM_IS_NA       1
+#define	SUM_OVERFLOWED  2
+
+/* Process rows i1 <= i < i2 of 'x'. 'acc' and 'status' must be zero-filled
+   buffers of the same length as 'out'. */
+KERNEL_INLINE int colsum_int_rows_body(const int *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_ncol,
+		long long int *acc, long long int *status,
+		int i1, int i2)
+{
+	int n = i2 - i1;
+	for (int j = 0; j < x_ncol; j++) {
+		int g = groups[j];
+		if (g == NA_INTEGER)
+			g = out_ncol;
+		g--;  // from 1-base to 0-base
+		R_xlen_t offset = (R_xlen_t) g * x_nrow + i1;
+		const int *restrict x_p = x + (R_xlen_t) j * x_nrow + i1;
+		long long int *restrict acc_p = acc + offset;
+		long long int *restrict status_p = status + offset;
+		/* We use bitwise operators instead of && and ||, and
+		   'status' has the same width as 'acc', so the loops below
+		   get vectorized. */
+		if (narm) {
+			#pragma omp simd
+			for (int i = 0; i < n; i++) {
+				int v = x_p[i];
+				long long int y = acc_p[i] +
+						  (v == NA_INTEGER ? 0 : v);
+				long long int y_is_out = (y < -INT_MAX) |
+							 (y > INT_MAX);
+				acc_p[i] = y;
+				status_p[i] |= y_is_out * SUM_OVERFLOWED;
+			}
+		} else {
+			#pragma omp simd
+			for (int i = 0; i < n; i++) {
+				int v = x_p[i];
+				long long int v_is_na = v == NA_INTEGER;
+				long long int st = status_p[i] |
+						   v_is_na * SUM_IS_NA;
+				long long int y = acc_p[i] + (v_is_na ? 0 : v);
+				long long int y_is_out = (y < -INT_MAX) |
+							 (y > INT_MAX);
+				acc_p[i] = y;
+				/* Like in rowsum_int_cols(), an overflow
+				   only counts if no NA was seen before. */
+				status_p[i] = st | ((st == 0) & y_is_out) *
+						   SUM_OVERFLOWED;
+			}
+		}
+	}
+	/* Move the sums to 'out'. */
+	int overflow = 0;
+	for (int g = 0; g < out_ncol; g++) {
+		R_xlen_t offset = (R_xlen_t) g * x_nrow;
+		for (int i = i1; i < i2; i++) {
+			R_xlen_t k = offset + i;
+			if (status[k] & SUM_OVERFLOWED)
+				overflow = 1;
+			out[k] = status[k] ? NA_INTEGER : (int) acc[k];
+		}
+	}
+	return overflow;
+}
+
+static void colsum_double_rows_default(const double *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_ncol,
+		int i1, int i2)
+{
+	colsum_double_rows_body(x, x_nrow, x_ncol, groups, narm,
+				out, out_ncol, i1, i2);
+}
+
+static int colsum_int_rows_default(const int *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_ncol,
+		long long int *acc, long long int *status,
+		int i1, int i2)
+{
+	return colsum_int_rows_body(x, x_nrow, x_ncol, groups, narm,
+				    out, out_ncol, acc, status, i1, i2);
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void colsum_double_rows_avx2(const double *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_ncol,
+		int i1, int i2)
+{
+	colsum_double_rows_body(x, x_nrow, x_ncol, groups, narm,
+				out, out_ncol, i1, i2);
+}
+
+__attribute__((target("avx2")))
+static int colsum_int_rows_avx2(const int *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_ncol,
+		long long int *acc, long long int *status,
+		int i1, int i2)
+{
+	return colsum_int_rows_body(x, x_nrow, x_ncol, groups, narm,
+				    out, out_ncol, acc, status, i1, i2);
+}
+#endif  /* HAVE_AVX2_KERNELS */
+
+static void (*colsum_double_rows)(const double *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_ncol,
+		int i1, int i2) = colsum_double_rows_default;
+
+static int (*colsum_int_rows)(const int *x,
+		int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_ncol,
+		long long int *acc, long long int *status,
+		int i1, int i2) = colsum_int_rows_default;
+
+/* Called by R_init_S4Arrays(). */
+void init_rowsum_kernels(void)
+{
+#ifdef HAVE_AVX2_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		colsum_double_rows = colsum_double_rows_avx2;
+		colsum_int_rows = colsum_int_rows_avx2;
+	}
+#endif
+	return;
+}
+
+static void compute_colsum_double(const double *x, int x_nrow, int x_ncol,
+		const int *groups, int narm, double *out, int out_ncol,
+		int nthread)
+{
+	memset(out, 0, sizeof(double) * (R_xlen_t) x_nrow * out_ncol);
+	int nchunk = compute_nchunk(nthread, x_nrow,
+				    (R_xlen_t) x_nrow * x_ncol);
+	#pragma omp parallel for num_threads(nchunk) schedule(static)
+	for (int k = 0; k < nchunk; k++)
+		colsum_double_rows(x, x_nrow, x_ncol, groups, narm,
+				   out, out_ncol,
+				   CHUNK_START(k, x_nrow, nchunk),
+				   CHUNK_START(k + 1, x_nrow, nchunk));
+	return;
+}
+
+static void compute_colsum_int(const int *x, int x_nrow, int x_ncol,
+		const int *groups, int narm, int *out, int out_ncol,
+		int nthread)
+{
+	R_xlen_t out_len = (R_xlen_t) x_nrow * out_ncol;
+	if (out_len == 0)
+		return;
+	long long int *acc = (long long int *)
+		R_alloc(out_len, sizeof(long long int));
+	memset(acc, 0, sizeof(long long int) * out_len);
+	long long int *status = (long long int *)
+		R_alloc(out_len, sizeof(long long int));
+	memset(status, 0, sizeof(long long int) * out_len);
+	int nchunk = compute_nchunk(nthread, x_nrow,
+				    (R_xlen_t) x_nrow * x_ncol);
+	int overflow = 0;
+	#pragma omp parallel for num_threads(nchunk) schedule(static) \
+		reduction(|:overflow)
+	for (int k = 0; k < nchunk; k++)
+		overflow |= colsum_int_rows(x, x_nrow, x_ncol, groups, narm,
+					    out, out_ncol, acc, status,
+					    CHUNK_START(k, x_nrow, nchunk),
+					    CHUNK_START(k + 1, x_nrow, nchunk));
 	if (overflow)
 		warning("NAs produced by integer overflow");
 	return;
@@ -108,7 +408,7 @@ static void compute_colsum_int(const int *x, int x_nrow, int x_ncol,
  */
 
 /* --- .Call ENTRY POINT --- */
-SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
+SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm, SEXP nthread)
 {
 	SEXP x_dim = GET_DIM(x);
 	if (x_dim == R_NilValue || LENGTH(x_dim) != 2)
@@ -116,16 +416,12 @@ SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 	int x_nrow = INTEGER(x_dim)[0];
 	int x_ncol = INTEGER(x_dim)[1];
 	int narm = LOGICAL(na_rm)[0];
+	int nthr = get_nthread(nthread);
 
 	int ans_nrow = INTEGER(ngroup)[0];
 	check_group(group, x_nrow, ans_nrow);
 
-	reset_ovflow_flag();
-	/* Only to detect a potential integer overflow. The returned value
-	   is actually not needed so we ignore it. */
-	safe_int_mult(ans_nrow, x_ncol);
-	if (get_ovflow_flag())
-		error("too many groups (matrix of sums will be too big)");
+	check_ans_len(ans_nrow, x_ncol, "matrix of sums");
 
 	SEXP ans;
 	/* Note that base::rowsum() only supports numeric matrices i.e.
@@ -135,12 +431,12 @@ SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 		ans = PROTECT(allocMatrix(REALSXP, ans_nrow, x_ncol));
 		compute_rowsum_double(REAL(x), x_nrow, x_ncol,
 				      INTEGER(group), narm,
-				      REAL(ans), ans_nrow);
+				      REAL(ans), ans_nrow, nthr);
 	} else if (x_Rtype == INTSXP) {
 		ans = PROTECT(allocMatrix(INTSXP, ans_nrow, x_ncol));
 		compute_rowsum_int(INTEGER(x), x_nrow, x_ncol,
 				   INTEGER(group), narm,
-				   INTEGER(ans), ans_nrow);
+				   INTEGER(ans), ans_nrow, nthr);
 	} else {
 		error("rowsum() and colsum() do not support "
 		      "matrices of type \"%s\" at the moment",
@@ -152,7 +448,7 @@ SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 }
 
 /* --- .Call ENTRY POINT --- */
-SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
+SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm, SEXP nthread)
 {
 	SEXP x_dim = GET_DIM(x);
 	if (x_dim == R_NilValue || LENGTH(x_dim) != 2)
@@ -160,16 +456,12 @@ SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 	int x_nrow = INTEGER(x_dim)[0];
 	int x_ncol = INTEGER(x_dim)[1];
 	int narm = LOGICAL(na_rm)[0];
+	int nthr = get_nthread(nthread);
 
 	int ans_ncol = INTEGER(ngroup)[0];
 	check_group(group, x_ncol, ans_ncol);
 
-	reset_ovflow_flag();
-	/* Only to detect a potential integer overflow. The returned value
-	   is actually not needed so we ignore it. */
-	safe_int_mult(x_nrow, ans_ncol);
-	if (get_ovflow_flag())
-		error("too many groups (matrix of sums will be too big)");
+	check_ans_len(x_nrow, ans_ncol, "matrix of sums");
 
 	SEXP ans;
 	/* Note that base::rowsum() only supports numeric matrices i.e.
@@ -179,12 +471,12 @@ SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 		ans = PROTECT(allocMatrix(REALSXP, x_nrow, ans_ncol));
 		compute_colsum_double(REAL(x), x_nrow, x_ncol,
 				      INTEGER(group), narm,
-				      REAL(ans), ans_ncol);
+				      REAL(ans), ans_ncol, nthr);
 	} else if (x_Rtype == INTSXP) {
 		ans = PROTECT(allocMatrix(INTSXP, x_nrow, ans_ncol));
 		compute_colsum_int(INTEGER(x), x_nrow, x_ncol,
 				   INTEGER(group), narm,
-				   INTEGER(ans), ans_ncol);
+				   INTEGER(ans), ans_ncol, nthr);
 	} else {
 		error("rowsum() and colsum() do not support "
 		      "matrices of type \"%s\" at the moment",
@@ -195,3 +487,382 @@ SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 	return ans;
 }
 
+
+
+/****************************************************************************
+ * Grouped reductions: C_rowstats() and C_colstats()
+ *
+ * A generalization of C_rowsum()/C_colsum() that computes any combination
+ * of the following grouped reductions in a single pass over 'x':
+ *   o "sum":     sum of the values in the group;
+ *   o "mean":    mean of the values in the group;
+ *   o "min":     smallest value in the group;
+ *   o "max":     biggest value in the group;
+ *   o "count":   number of non-NA values in the group;
+ *   o "nzcount": number of nonzero values in the group.
+ * When 'na.rm' is FALSE, any NA or NaN in a group propagates to all the
+ * above reductions except "count". When 'na.rm' is TRUE, NAs and NaNs are
+ * ignored, in which case the "min" and "max" of a group with no non-NA
+ * values are Inf and -Inf for double input (like with base::min() and
+ * base::max(), but without a warning) and NA for integer input. The "mean"
+ * of such group is NaN.
+ *
+ * Each reduction of a given group is stored in a "cell" of the matrix
+ * associated with the reduction. For rowstats(), x[i, j] contributes to
+ * cell k = (g_i, j), and for colstats(), to cell k = (i, g_j). In both
+ * cases the 0-based linear index of the cell can be written
+ * 'k = row_off[i] + col_off[j]', which allows us to use the same engine
+ * for rowstats() and colstats(). Multithreading is implemented the same
+ * way as for rowsum() and colsum() i.e. the work is split along the
+ * columns of 'x' for rowstats() and along its rows for colstats(), so each
+ * thread updates its own set of cells and the result doesn't depend on
+ * the number of threads.
+ */
+
+#define	OP_SUM          0
+#define	OP_MEAN         1
+#define	OP_MIN          2
+#define	OP_MAX          3
+#define	OP_COUNT        4
+#define	OP_NZCOUNT      5
+#define	NOPS            6
+
+static const char *op_names[NOPS] = {
+	"sum", "mean", "min", "max", "count", "nzcount"
+};
+
+typedef struct grouped_stats_bufs_t {
+	int has_op[NOPS];
+	int narm;
+	double *sum;          /* "sum" and "mean" on double input */
+	long long int *isum;  /* "sum" and "mean" on int input */
+	void *min, *max;      /* double * or int * */
+	int *count;           /* always used */
+	int *nzcount;
+	char *isna;           /* only used when 'narm' is FALSE */
+} GroupedStatsBufs;
+
+/* Values of the 'isna' buffer. We need to distinguish between NA and NaN
+   on double input because, like base::min() and base::max(), the "min" and
+   "max" of a group are NA if it contains an NA, and NaN if it contains NaNs
+   but no NA. */
+#define	SEEN_NAN        1
+#define	SEEN_NA         2
+
+static int op_name_to_code(SEXP op_name)
+{
+	if (op_name != NA_STRING) {
+		const char *s = CHAR(op_name);
+		for (int op = 0; op < NOPS; op++)
+			if (strcmp(s, op_names[op]) == 0)
+				return op;
+	}
+	error("'op' must be a character vector containing one or more "
+	      "of: \"sum\", \"mean\", \"min\", \"max\", \"count\", "
+	      "\"nzcount\"");
+}
+
+static inline void update_double_cell(const GroupedStatsBufs *bufs,
+		R_xlen_t k, double v)
+{
+	/* ISNAN(): True for *both* NA and NaN. See <R_ext/Arith.h> */
+	if (ISNAN(v)) {
+		if (!bufs->narm) {
+			/* R_IsNA(): True for NA only. */
+			if (R_IsNA(v))
+				bufs->isna[k] = SEEN_NA;
+			else if (bufs->isna[k] == 0)
+				bufs->isna[k] = SEEN_NAN;
+			/* Propagate the NA or NaN. */
+			if (bufs->sum != NULL)
+				bufs->sum[k] += v;
+		}
+		return;
+	}
+	if (bufs->sum != NULL)
+		bufs->sum[k] += v;
+	if (bufs->has_op[OP_MIN] && v < ((double *) bufs->min)[k])
+		((double *) bufs->min)[k] = v;
+	if (bufs->has_op[OP_MAX] && v > ((double *) bufs->max)[k])
+		((double *) bufs->max)[k] = v;
+	if (bufs->has_op[OP_NZCOUNT] && v != 0.0)
+		bufs->nzcount[k]++;
+	bufs->count[k]++;
+	return;
+}
+
+static inline void update_int_cell(const GroupedStatsBufs *bufs,
+		R_xlen_t k, int v)
+{
+	if (v == NA_INTEGER) {
+		if (!bufs->narm)
+			bufs->isna[k] = SEEN_NA;
+		return;
+	}
+	if (bufs->isum != NULL)
+		bufs->isum[k] += v;
+	if (bufs->has_op[OP_MIN] && v < ((int *) bufs->min)[k])
+		((int *) bufs->min)[k] = v;
+	if (bufs->has_op[OP_MAX] && v > ((int *) bufs->max)[k])
+		((int *) bufs->max)[k] = v;
+	if (bufs->has_op[OP_NZCOUNT] && v != 0)
+		bufs->nzcount[k]++;
+	bufs->count[k]++;
+	return;
+}
+
+/* Walk on x[i1:i2, j1:j2] (0-based, end excluded). Exactly one of 'x_dbl'
+   or 'x_int' must be non-NULL. */
+static void update_cells(const double *x_dbl, const int *x_int, int x_nrow,
+		const R_xlen_t *row_off, const R_xlen_t *col_off,
+		const GroupedStatsBufs *bufs,
+		int i1, int i2, int j1, int j2)
+{
+	for (int j = j1; j < j2; j++) {
+		R_xlen_t x_off = (R_xlen_t) j * x_nrow;
+		if (x_dbl != NULL) {
+			const double *x_p = x_dbl + x_off;
+			for (int i = i1; i < i2; i++)
+				update_double_cell(bufs, row_off[i] + col_off[j],
+						   x_p[i]);
+		} else {
+			const int *x_p = x_int + x_off;
+			for (int i = i1; i < i2; i++)
+				update_int_cell(bufs, row_off[i] + col_off[j],
+						x_p[i]);
+		}
+	}
+	return;
+}
+
+/* Allocate the matrices that will receive the reductions and the extra
+   buffers needed by the engine, and initialize everything. */
+static SEXP alloc_grouped_stats(SEXPTYPE x_Rtype, int ans_nrow, int ans_ncol,
+		const int *ops, int nop, int narm, GroupedStatsBufs *bufs)
+{
+	R_xlen_t ncell = (R_xlen_t) ans_nrow * ans_ncol;
+	memset(bufs, 0, sizeof(GroupedStatsBufs));
+	bufs->narm = narm;
+	for (int r = 0; r < nop; r++)
+		bufs->has_op[ops[r]] = 1;
+
+	SEXP ans = PROTECT(NEW_LIST(NOPS));
+	for (int op = 0; op < NOPS; op++) {
+		if (!bufs->has_op[op])
+			continue;
+		SEXPTYPE Rtype;
+		if (op == OP_MEAN) {
+			Rtype = REALSXP;
+		} else if (op == OP_COUNT || op == OP_NZCOUNT) {
+			Rtype = INTSXP;
+		} else {
+			Rtype = x_Rtype;
+		}
+		SET_VECTOR_ELT(ans, op, allocMatrix(Rtype, ans_nrow, ans_ncol));
+	}
+
+	/* "sum" or "mean" accumulators. */
+	if (bufs->has_op[OP_SUM] || bufs->has_op[OP_MEAN]) {
+		if (x_Rtype == REALSXP) {
+			bufs->sum = bufs->has_op[OP_SUM] ?
+				REAL(VECTOR_ELT(ans, OP_SUM)) :
+				(double *) R_alloc(ncell, sizeof(double));
+			memset(bufs->sum, 0, sizeof(double) * ncell);
+		} else {
+			bufs->isum = (long long int *)
+				R_alloc(ncell, sizeof(long long int));
+			memset(bufs->isum, 0, sizeof(long long int) * ncell);
+		}
+	}
+	/* "min" and "max" accumulators. */
+	if (bufs->has_op[OP_MIN])
+		bufs->min = DATAPTR(VECTOR_ELT(ans, OP_MIN));
+	if (bufs->has_op[OP_MAX])
+		bufs->max = DATAPTR(VECTOR_ELT(ans, OP_MAX));
+	for (R_xlen_t k = 0; k < ncell; k++) {
+		if (x_Rtype == REALSXP) {
+			if (bufs->min != NULL)
+				((double *) bufs->min)[k] = R_PosInf;
+			if (bufs->max != NULL)
+				((double *) bufs->max)[k] = R_NegInf;
+		} else {
+			if (bufs->min != NULL)
+				((int *) bufs->min)[k] = INT_MAX;
+			/* NA_INTEGER is INT_MIN and cannot be a valid value. */
+			if (bufs->max != NULL)
+				((int *) bufs->max)[k] = NA_INTEGER;
+		}
+	}
+	/* "count" and "nzcount" accumulators. */
+	bufs->count = bufs->has_op[OP_COUNT] ?
+		INTEGER(VECTOR_ELT(ans, OP_COUNT)) :
+		(int *) R_alloc(ncell, sizeof(int));
+	memset(bufs->count, 0, sizeof(int) * ncell);
+	if (bufs->has_op[OP_NZCOUNT]) {
+		bufs->nzcount = INTEGER(VECTOR_ELT(ans, OP_NZCOUNT));
+		memset(bufs->nzcount, 0, sizeof(int) * ncell);
+	}
+	if (!narm) {
+		bufs->isna = R_alloc(ncell, sizeof(char));
+		memset(bufs->isna, 0, sizeof(char) * ncell);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Turn the accumulated values into the final reductions. Return 1 if an
+   integer overflow occured, and 0 otherwise. */
+static int finalize_grouped_stats(SEXP ans, SEXPTYPE x_Rtype, R_xlen_t ncell,
+		const GroupedStatsBufs *bufs)
+{
+	int overflow = 0;
+	for (R_xlen_t k = 0; k < ncell; k++) {
+		int isna = bufs->isna != NULL && bufs->isna[k];
+		int count = bufs->count[k];
+		if (bufs->has_op[OP_NZCOUNT] && isna)
+			bufs->nzcount[k] = NA_INTEGER;
+		if (x_Rtype == REALSXP) {
+			if (bufs->has_op[OP_MEAN])
+				REAL(VECTOR_ELT(ans, OP_MEAN))[k] =
+					bufs->sum[k] / count;
+			if (isna) {
+				double v = bufs->isna[k] == SEEN_NA ?
+						NA_REAL : R_NaN;
+				if (bufs->has_op[OP_MIN])
+					((double *) bufs->min)[k] = v;
+				if (bufs->has_op[OP_MAX])
+					((double *) bufs->max)[k] = v;
+			}
+			continue;
+		}
+		if (bufs->has_op[OP_SUM]) {
+			int *sum_p = INTEGER(VECTOR_ELT(ans, OP_SUM)) + k;
+			long long int isum = bufs->isum[k];
+			if (isna) {
+				*sum_p = NA_INTEGER;
+			} else if (-INT_MAX <= isum && isum <= INT_MAX) {
+				*sum_p = (int) isum;
+			} else {
+				overflow = 1;
+				*sum_p = NA_INTEGER;
+			}
+		}
+		if (bufs->has_op[OP_MEAN])
+			REAL(VECTOR_ELT(ans, OP_MEAN))[k] =
+				isna ? NA_REAL :
+				count == 0 ? R_NaN :
+				(double) bufs->isum[k] / count;
+		if (bufs->has_op[OP_MIN] && (isna || count == 0))
+			((int *) bufs->min)[k] = NA_INTEGER;
+		if (bufs->has_op[OP_MAX] && (isna || count == 0))
+			((int *) bufs->max)[k] = NA_INTEGER;
+	}
+	return overflow;
+}
+
+static SEXP grouped_stats(SEXP x, SEXP group, SEXP ngroup, SEXP op,
+		SEXP na_rm, SEXP nthread, int along_rows)
+{
+	SEXP x_dim = GET_DIM(x);
+	if (x_dim == R_NilValue || LENGTH(x_dim) != 2)
+		error("input object must have 2 dimensions");
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+	SEXPTYPE x_Rtype = TYPEOF(x);
+	if (x_Rtype != REALSXP && x_Rtype != INTSXP)
+		error("rowstats() and colstats() do not support "
+		      "matrices of type \"%s\" at the moment",
+		      type2char(x_Rtype));
+	if (!IS_CHARACTER(op) || LENGTH(op) == 0)
+		error("'op' must be a non-empty character vector");
+	int nop = LENGTH(op);
+	int *ops = (int *) R_alloc(nop, sizeof(int));
+	for (int r = 0; r < nop; r++)
+		ops[r] = op_name_to_code(STRING_ELT(op, r));
+	int narm = LOGICAL(na_rm)[0];
+	int nthr = get_nthread(nthread);
+
+	int n = INTEGER(ngroup)[0];
+	check_group(group, along_rows ? x_nrow : x_ncol, n);
+	int ans_nrow = along_rows ? n : x_nrow;
+	int ans_ncol = along_rows ? x_ncol : n;
+
+	check_ans_len(ans_nrow, ans_ncol, "matrices of results");
+
+	/* Set up the "cell mapping" (see above). */
+	const int *groups = INTEGER(group);
+	R_xlen_t *row_off = (R_xlen_t *) R_alloc(x_nrow, sizeof(R_xlen_t));
+	R_xlen_t *col_off = (R_xlen_t *) R_alloc(x_ncol, sizeof(R_xlen_t));
+	for (int i = 0; i < x_nrow; i++) {
+		if (along_rows) {
+			int g = groups[i];
+			row_off[i] = g == NA_INTEGER ? n - 1 : g - 1;
+		} else {
+			row_off[i] = i;
+		}
+	}
+	for (int j = 0; j < x_ncol; j++) {
+		if (along_rows) {
+			col_off[j] = (R_xlen_t) j * n;
+		} else {
+			int g = groups[j];
+			g = g == NA_INTEGER ? n - 1 : g - 1;
+			col_off[j] = (R_xlen_t) g * x_nrow;
+		}
+	}
+
+	GroupedStatsBufs bufs;
+	SEXP stats = PROTECT(alloc_grouped_stats(x_Rtype, ans_nrow, ans_ncol,
+						 ops, nop, narm, &bufs));
+	const double *x_dbl = x_Rtype == REALSXP ? REAL(x) : NULL;
+	const int *x_int = x_Rtype == INTSXP ? INTEGER(x) : NULL;
+	R_xlen_t x_len = (R_xlen_t) x_nrow * x_ncol;
+	int nchunk = compute_nchunk(nthr, along_rows ? x_ncol : x_nrow,
+				    x_len);
+	#pragma omp parallel for num_threads(nchunk) schedule(static)
+	for (int k = 0; k < nchunk; k++) {
+		if (along_rows) {
+			update_cells(x_dbl, x_int, x_nrow,
+				     row_off, col_off, &bufs,
+				     0, x_nrow,
+				     CHUNK_START(k, x_ncol, nchunk),
+				     CHUNK_START(k + 1, x_ncol, nchunk));
+		} else {
+			update_cells(x_dbl, x_int, x_nrow,
+				     row_off, col_off, &bufs,
+				     CHUNK_START(k, x_nrow, nchunk),
+				     CHUNK_START(k + 1, x_nrow, nchunk),
+				     0, x_ncol);
+		}
+	}
+	int overflow = finalize_grouped_stats(stats, x_Rtype,
+				(R_xlen_t) ans_nrow * ans_ncol, &bufs);
+	if (overflow)
+		warning("NAs produced by integer overflow");
+
+	/* Return the matrices in the order specified in 'op'. */
+	SEXP ans = PROTECT(NEW_LIST(nop));
+	SEXP ans_names = PROTECT(NEW_CHARACTER(nop));
+	for (int r = 0; r < nop; r++) {
+		SET_VECTOR_ELT(ans, r, VECTOR_ELT(stats, ops[r]));
+		SET_STRING_ELT(ans_names, r, mkChar(op_names[ops[r]]));
+	}
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(3);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_rowstats(SEXP x, SEXP group, SEXP ngroup, SEXP op,
+		SEXP na_rm, SEXP nthread)
+{
+	return grouped_stats(x, group, ngroup, op, na_rm, nthread, 1);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_colstats(SEXP x, SEXP group, SEXP ngroup, SEXP op,
+		SEXP na_rm, SEXP nthread)
+{
+	return grouped_stats(x, group, ngroup, op, na_rm, nthread, 0);
+}
+
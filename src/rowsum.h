@@ -3,8 +3,17 @@
 
 #include <Rdefines.h>
 
-SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm);
-SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm);
+void init_rowsum_kernels(void);
+
+SEXP C_rowsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm,
+		SEXP nthread);
+SEXP C_colsum(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm,
+		SEXP nthread);
+
+SEXP C_rowstats(SEXP x, SEXP group, SEXP ngroup, SEXP op,
+		SEXP na_rm, SEXP nthread);
+SEXP C_colstats(SEXP x, SEXP group, SEXP ngroup, SEXP op,
+		SEXP na_rm, SEXP nthread);
 
 #endif  /* _ROWSUM_H_ */
 
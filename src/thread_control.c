@@ -0,0 +1,38 @@
+/****************************************************************************
+ *                              Thread control                              *
+ ****************************************************************************/
+#include "thread_control.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/* Check and normalize the 'nthread' argument passed to the .Call entry
+   points that support multithreading. Always return 1 if S4Arrays was
+   compiled without OpenMP support. */
+int get_nthread(SEXP nthread)
+{
+	if (!IS_INTEGER(nthread) || LENGTH(nthread) != 1)
+		error("'nthread' must be a single integer");
+	int n = INTEGER(nthread)[0];
+	if (n == NA_INTEGER || n < 1)
+		error("'nthread' must be >= 1");
+#ifdef _OPENMP
+	int max_nthread = omp_get_thread_limit();
+	return n <= max_nthread ? n : max_nthread;
+#else
+	return 1;
+#endif
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_num_procs(void)
+{
+#ifdef _OPENMP
+	return ScalarInteger(omp_get_num_procs());
+#else
+	return ScalarInteger(1);
+#endif
+}
+
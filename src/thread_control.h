@@ -0,0 +1,30 @@
+#ifndef _THREAD_CONTROL_H_
+#define _THREAD_CONTROL_H_
+
+#include <Rdefines.h>
+
+/* We don't bother spawning threads for inputs with less elements. */
+#define	MIN_NELT_PER_THREAD 65536
+
+/* Number of chunks to use when splitting 'n' items that cover a total of
+   'x_len' elements across at most 'nthread' threads. */
+static inline int compute_nchunk(int nthread, R_xlen_t n, R_xlen_t x_len)
+{
+	if (nthread > n)
+		nthread = (int) n;
+	if (nthread <= 1 || x_len < (R_xlen_t) MIN_NELT_PER_THREAD * 2)
+		return 1;
+	R_xlen_t max_nchunk = x_len / MIN_NELT_PER_THREAD;
+	return nthread <= max_nchunk ? nthread : (int) max_nchunk;
+}
+
+/* Start of chunk 'k' when splitting 'n' items in 'nchunk' chunks. */
+#define	CHUNK_START(k, n, nchunk) \
+	((R_xlen_t) (k) * (n) / (nchunk))
+
+int get_nthread(SEXP nthread);
+
+SEXP C_get_num_procs(void);
+
+#endif  /* _THREAD_CONTROL_H_ */
+